@@ -0,0 +1,497 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/huffman.h"
+#include "../src/bitstream.h"
+#include "../src/block.h"
+#include "../src/buffer.h"
+#include "../src/dictionary.h"
+#include "../src/histogram.h"
+#include "../src/scratch.h"
+#include "../src/heap/dary_heap.h"
+#include "../src/heap/min_heap.h"
+
+/* Every heap allocation in the process goes through these so benchmarks can
+ * report allocations per iteration next to their throughput.*/
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC sees free() on memory from operator new once these are inlined, which is
+// exactly the pairing replacing both is meant to set up.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Counts allocations made while a benchmark's timing loop runs.
+class AllocationCounter {
+public:
+    AllocationCounter() : start_(allocations.load(std::memory_order_relaxed)) {}
+
+    void report(benchmark::State& state) const {
+        auto total = allocations.load(std::memory_order_relaxed) - this->start_;
+        state.counters["allocs"] = benchmark::Counter(static_cast<double>(total), benchmark::Counter::kAvgIterations);
+    }
+private:
+    uint64_t start_;
+};
+
+enum Corpus {
+    Uniform,
+    Skewed,
+    Text,
+    Binary,
+    Sparse,
+};
+
+static const char* corpus_name(int corpus) {
+    switch (corpus) {
+        case Uniform: return "uniform";
+        case Skewed: return "skewed";
+        case Text: return "text";
+        case Binary: return "binary";
+        case Sparse: return "sparse";
+        default: return "?";
+    }
+}
+
+/* Generated inputs, all deterministic:
+ *   uniform  every byte value equally likely, incompressible
+ *   skewed   geometric distribution, a few bytes make up most of the input
+ *   text     tests/lm.txt repeated to size
+ *   binary   little endian records of small counters, ids and zero padding
+ *   sparse   zeroed 4KB pages with a random 16 byte record at the start of each*/
+static const std::vector<uint8_t>& corpus(int kind, size_t size) {
+    static std::map<std::pair<int, size_t>, std::vector<uint8_t>> cache;
+    auto& data = cache[{kind, size}];
+    if (!data.empty()) {
+        return data;
+    }
+
+    data.resize(size);
+    std::mt19937_64 rng(42);
+    switch (kind) {
+        case Uniform:
+            for (auto& b : data) {
+                b = static_cast<uint8_t>(rng());
+            }
+            break;
+        case Skewed: {
+            std::geometric_distribution<int> dist(0.2);
+            for (auto& b : data) {
+                b = static_cast<uint8_t>(std::min(dist(rng), 255));
+            }
+            break;
+        }
+        case Text: {
+            std::ifstream in("../tests/lm.txt", std::ios::binary);
+            std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+            if (text.empty()) {
+                throw std::runtime_error("Could not read ../tests/lm.txt, run the benchmarks from the build directory.");
+            }
+            for (size_t i = 0; i < size; ++i) {
+                data[i] = static_cast<uint8_t>(text[i % text.size()]);
+            }
+            break;
+        }
+        case Binary: {
+            uint32_t id = 1000;
+            for (size_t i = 0; i + 16 <= size; i += 16) {
+                id += rng() % 4;
+                store_le32(data.data() + i, id);
+                store_le32(data.data() + i + 4, static_cast<uint32_t>(rng() % 300));
+                store_le64(data.data() + i + 8, rng() % 8 == 0 ? rng() : 0);
+            }
+            break;
+        }
+        case Sparse:
+            for (size_t i = 0; i + 16 <= size; i += 4096) {
+                store_le64(data.data() + i, rng());
+                store_le64(data.data() + i + 8, rng());
+            }
+            break;
+        default:
+            break;
+    }
+    return data;
+}
+
+static void label(benchmark::State& state, int kind, size_t size) {
+    state.SetLabel(std::string(corpus_name(kind)) + "/" + std::to_string(size >> 10) + "KB");
+}
+
+// {corpus, size} for every generated corpus at 64KB, 1MB and 16MB.
+static void corpus_args(benchmark::internal::Benchmark* b) {
+    for (int kind : {Uniform, Skewed, Text, Binary, Sparse}) {
+        for (int64_t size : {64 << 10, 1 << 20, 16 << 20}) {
+            b->Args({kind, size});
+        }
+    }
+}
+
+static void BM_Histogram(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(histogram(data.data(), data.size()));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_Histogram)->Apply(corpus_args);
+
+static void BM_BuildCharMap(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(build_char_map(data.data(), data.size()));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_BuildCharMap)->Apply(corpus_args);
+
+static void BM_TreeBuild(benchmark::State& state) {
+    auto strategy = static_cast<SprayPaintBuildStrategy>(state.range(1));
+    const auto& data = corpus(static_cast<int>(state.range(0)), 1 << 20);
+    auto tree = SprayPaintTree();
+    tree.register_charset(histogram(data.data(), data.size()));
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        tree.build(strategy);
+        benchmark::DoNotOptimize(tree);
+    }
+    allocs.report(state);
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(std::string(corpus_name(state.range(0))) +
+                   (strategy == SprayPaintBuildStrategy::Heap ? "/heap" : "/two-queue"));
+}
+BENCHMARK(BM_TreeBuild)->ArgsProduct({{Uniform, Skewed, Text, Binary},
+                                      {static_cast<int64_t>(SprayPaintBuildStrategy::Heap),
+                                       static_cast<int64_t>(SprayPaintBuildStrategy::TwoQueue)}});
+
+static void BM_Encode(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), 1 << 20);
+    auto tree = SprayPaintTree();
+    tree.register_charset(histogram(data.data(), data.size()));
+    tree.build();
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.encode_table());
+    }
+    allocs.report(state);
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(corpus_name(state.range(0)));
+}
+BENCHMARK(BM_Encode)->DenseRange(Uniform, Binary);
+
+// Whole block: histogram, tree, code lengths and bit packing.
+static void BM_CompressBlock(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    AllocationCounter allocs;
+    size_t compressed = 0;
+    for (auto _ : state) {
+        auto block = compress_block(data.data(), data.size());
+        compressed = block.size();
+        benchmark::DoNotOptimize(block);
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    state.counters["ratio"] = static_cast<double>(compressed) / data.size();
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_CompressBlock)->Apply(corpus_args);
+
+static void BM_DecompressBlock(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    auto block = compress_block(data.data(), data.size());
+    auto header = read_block_header(block.data());
+    std::vector<uint8_t> out(data.size());
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        decompress_block(header, block.data() + kBlockHeaderSize, out.data());
+        benchmark::DoNotOptimize(out.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_DecompressBlock)->Apply(corpus_args);
+
+static void BM_DecompressInterleavedBlock(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    auto block = compress_interleaved_block(data.data(), data.size());
+    auto header = read_block_header(block.data());
+    std::vector<uint8_t> out(data.size());
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        decompress_block(header, block.data() + kBlockHeaderSize, out.data());
+        benchmark::DoNotOptimize(out.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    state.counters["ratio"] = static_cast<double>(block.size()) / data.size();
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_DecompressInterleavedBlock)->Apply(corpus_args);
+
+// Context blocks take their decoders from scratch, as the file and buffer APIs
+// pass it, so this times decoding rather than allocating them.
+static void BM_DecompressContextBlock(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    auto block = compress_context_block(data.data(), data.size());
+    auto header = read_block_header(block.data());
+    std::vector<uint8_t> out(data.size());
+    SprayPaintBlockScratch scratch;
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        decompress_block(header, block.data() + kBlockHeaderSize, out.data(), kMaxCodeLength, nullptr, &scratch);
+        benchmark::DoNotOptimize(out.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    state.counters["ratio"] = static_cast<double>(block.size()) / data.size();
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_DecompressContextBlock)->Apply(corpus_args);
+
+// In memory API on one thread with buffers reused across iterations, which
+// should not allocate at all.
+static void BM_CompressBuffer(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    SprayPaintOptions options;
+    options.threads = 1;
+    std::vector<std::byte> out(compress_bound(data.size(), options));
+
+    AllocationCounter allocs;
+    size_t compressed = 0;
+    for (auto _ : state) {
+        compressed = compress(std::as_bytes(std::span(data)), out, options);
+        benchmark::DoNotOptimize(out.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    state.counters["ratio"] = static_cast<double>(compressed) / data.size();
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_CompressBuffer)->Apply(corpus_args);
+
+static void BM_DecompressBuffer(benchmark::State& state) {
+    const auto& data = corpus(static_cast<int>(state.range(0)), state.range(1));
+    SprayPaintOptions options;
+    options.threads = 1;
+    std::vector<std::byte> compressed(compress_bound(data.size(), options));
+    compressed.resize(compress(std::as_bytes(std::span(data)), compressed, options));
+    std::vector<std::byte> out(data.size());
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        decompress(compressed, out, options);
+        benchmark::DoNotOptimize(out.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * data.size());
+    label(state, state.range(0), data.size());
+}
+BENCHMARK(BM_DecompressBuffer)->Apply(corpus_args);
+
+// Dictionary trained on the first 64KB of the text corpus, the messages come
+// from the rest of it.
+static const SprayPaintDictionary& text_dictionary() {
+    static const auto dictionary = SprayPaintDictionary::train(std::as_bytes(std::span(corpus(Text, 1 << 20).data(),
+                                                                                       64 << 10)));
+    return dictionary;
+}
+
+static SprayPaintOptions message_options(benchmark::State& state) {
+    SprayPaintOptions options;
+    options.threads = 1;
+    options.codec = static_cast<SprayPaintCodec>(state.range(0));
+    options.dictionary = &text_dictionary();
+    return options;
+}
+
+// {codec, message size} for the codecs worth using on small messages.
+static void message_args(benchmark::internal::Benchmark* b) {
+    b->ArgsProduct({{static_cast<int64_t>(SprayPaintCodec::Static), static_cast<int64_t>(SprayPaintCodec::Context),
+                     static_cast<int64_t>(SprayPaintCodec::Dictionary)},
+                    {256, 1 << 10, 4 << 10, 16 << 10}});
+}
+
+// Many small messages, one reused context per direction. After the first
+// message no iteration should allocate.
+static void BM_CompressMessages(benchmark::State& state) {
+    const auto& data = corpus(Text, 1 << 20);
+    auto size = static_cast<size_t>(state.range(1));
+    SprayPaintCompressor compressor(message_options(state));
+    std::vector<std::byte> out(compressor.compress_bound(size));
+
+    AllocationCounter allocs;
+    size_t pos = 64 << 10;
+    size_t compressed = 0;
+    for (auto _ : state) {
+        pos = pos + size > data.size() ? 64 << 10 : pos;
+        compressed += compressor.compress(std::as_bytes(std::span(data.data() + pos, size)), out);
+        benchmark::DoNotOptimize(out.data());
+        pos += size;
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetItemsProcessed(state.iterations());
+    state.counters["ratio"] = static_cast<double>(compressed) / (state.iterations() * size);
+}
+BENCHMARK(BM_CompressMessages)->Apply(message_args);
+
+static void BM_DecompressMessages(benchmark::State& state) {
+    const auto& data = corpus(Text, 1 << 20);
+    auto size = static_cast<size_t>(state.range(1));
+    auto options = message_options(state);
+    SprayPaintCompressor compressor(options);
+    std::vector<std::vector<std::byte>> messages;
+    for (size_t pos = 64 << 10; pos + size <= data.size(); pos += size) {
+        auto& message = messages.emplace_back(compressor.compress_bound(size));
+        message.resize(compressor.compress(std::as_bytes(std::span(data.data() + pos, size)), message));
+    }
+    SprayPaintDecompressor decompressor(options);
+    std::vector<std::byte> out(size);
+
+    AllocationCounter allocs;
+    size_t next = 0;
+    for (auto _ : state) {
+        decompressor.decompress(messages[next], out);
+        benchmark::DoNotOptimize(out.data());
+        next = next + 1 == messages.size() ? 0 : next + 1;
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecompressMessages)->Apply(message_args);
+
+// Writes the corpus to a scratch file so SprayPaintFile can map it.
+static std::string corpus_file(int kind, size_t size) {
+    auto path = (std::filesystem::temp_directory_path() /
+                 ("sp_bench_" + std::string(corpus_name(kind)) + "_" + std::to_string(size) + ".bin")).string();
+    if (!std::filesystem::exists(path) || std::filesystem::file_size(path) != size) {
+        const auto& data = corpus(kind, size);
+        std::ofstream out(path, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    return path;
+}
+
+static void BM_FileWrite(benchmark::State& state) {
+    auto size = static_cast<size_t>(state.range(1));
+    auto input = corpus_file(static_cast<int>(state.range(0)), size);
+    auto output = input + ".spz";
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        SprayPaintFile(output, input).write();
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * size);
+    state.counters["ratio"] = static_cast<double>(std::filesystem::file_size(output)) / size;
+    label(state, state.range(0), size);
+}
+BENCHMARK(BM_FileWrite)->Apply(corpus_args)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static void BM_FileRead(benchmark::State& state) {
+    auto size = static_cast<size_t>(state.range(1));
+    auto input = corpus_file(static_cast<int>(state.range(0)), size);
+    auto compressed = input + ".spz";
+    SprayPaintFile(compressed, input).write();
+    auto output = input + ".out";
+
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        SprayPaintFile(output, compressed).read();
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(state.iterations() * size);
+    label(state, state.range(0), size);
+}
+BENCHMARK(BM_FileRead)->Apply(corpus_args)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static std::vector<int> heap_values(size_t n) {
+    std::mt19937 rng(7);
+    std::vector<int> values(n);
+    for (auto& v : values) {
+        v = static_cast<int>(rng());
+    }
+    return values;
+}
+
+// n puts followed by n pops.
+static void BM_MinHeap(benchmark::State& state) {
+    auto values = heap_values(state.range(0));
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        auto heap = MinHeap<int>(static_cast<int>(values.size()));
+        for (auto v : values) {
+            heap.put(v);
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+            benchmark::DoNotOptimize(heap.pop());
+        }
+    }
+    allocs.report(state);
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK(BM_MinHeap)->Arg(256)->Arg(1 << 16);
+
+template <size_t Arity>
+static void BM_DaryHeap(benchmark::State& state) {
+    auto values = heap_values(state.range(0));
+    AllocationCounter allocs;
+    for (auto _ : state) {
+        auto heap = DaryMinHeap<int, Arity>();
+        heap.reserve(values.size());
+        for (auto v : values) {
+            heap.put(v);
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+            benchmark::DoNotOptimize(heap.pop());
+        }
+    }
+    allocs.report(state);
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK(BM_DaryHeap<2>)->Arg(256)->Arg(1 << 16);
+BENCHMARK(BM_DaryHeap<4>)->Arg(256)->Arg(1 << 16);
+BENCHMARK(BM_DaryHeap<8>)->Arg(256)->Arg(1 << 16);
+
+BENCHMARK_MAIN();
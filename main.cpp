@@ -1,5 +1,11 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <optional>
+#include <vector>
 
+#include "src/dictionary.h"
 #include "src/huffman.h"
 
 // Huffman encoding
@@ -13,43 +19,211 @@
 // Write the encoded tree and text to an output field
 
 void usage() {
-    std::cout << "Usage: ./spray_paint <flag> <filename> <output>\n"
+    std::cout << "Usage: ./spray_paint [--stats | --json-stats] [--adaptive | --context | --interleaved | --dict <dictionary>] [--block-size <bytes>] <flag> <filename> [<output>] [<offset> <length>]\n"
+              << "       ./spray_paint t <dictionary> <sample>...\n"
               << "\n"
               << "spray_paint is a file compression and decompression tool.\n"
               << "\n"
               << "Arguments:\n"
-              << "  <flag>       d or c for [d]ecompress or [c]ompress.\n"
-              << "  <filename>   The name of the file to compress or decompress.\n"
-              << "  <output>     The name of the output file for compression or decompression."
+              << "  <flag>       d, c, r or v for [d]ecompress, [c]ompress, [r]ange decompress or [v]erify.\n"
+              << "               t [t]rains a dictionary on the sample files and writes it to <dictionary>.\n"
+              << "  <filename>   The name of the file to compress or decompress, - for stdin.\n"
+              << "  <output>     The name of the output file for compression or decompression, - for stdout.\n"
+              << "               v takes no output, it checks every checksum without writing anything.\n"
+              << "  <offset>     r only: first byte of the original data to decompress.\n"
+              << "  <length>     r only: number of bytes to decompress.\n"
+              << "\n"
+              << "Options:\n"
+              << "  --stats      Print per phase timings and sizes to stderr when done.\n"
+              << "  --json-stats Same as --stats, as a single JSON object.\n"
+              << "  --adaptive   c only: code blocks in one pass with adaptive huffman codes, no code\n"
+              << "               length header. Slower, decompresses without the flag.\n"
+              << "  --context    c only: code each byte with a table picked by the byte before it.\n"
+              << "               Better ratio on structured text, decompresses without the flag.\n"
+              << "  --interleaved c only: split every block into 4 bitstreams that decode side by side.\n"
+              << "               Faster single core decompression, decompresses without the flag.\n"
+              << "  --dict <dictionary>  Code blocks with a dictionary made by t instead of storing codes in\n"
+              << "               every block, for small files. Decompressing needs the same dictionary.\n"
+              << "  --block-size <bytes>  c only: bytes per block, 1MB by default. Streamed output trails the\n"
+              << "               input by a block or two, smaller blocks cut that lag for some ratio.\n"
               << "\n"
               << "Examples:\n"
               << "  ./spraypaint c example.txt example.spz\n"
-              << "  ./spraypaint d example.spz example.txt\n\n";
+              << "  ./spraypaint d example.spz example.txt\n"
+              << "  ./spraypaint r example.spz slice.txt 1048576 4096\n"
+              << "  ./spraypaint v example.spz\n"
+              << "  ./spraypaint t messages.spd sample1.json sample2.json\n"
+              << "  ./spraypaint --dict messages.spd c message.json message.spz\n"
+              << "  tar c dir | ./spraypaint c - - | ssh host './spraypaint d - - | tar x'\n\n";
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
+    bool stats_text = false;
+    bool stats_json = false;
+    auto codec = SprayPaintCodec::Static;
+    const char* dictionary_file = nullptr;
+    const char* block_size = nullptr;
+    std::vector<char*> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            stats_text = true;
+        } else if (strcmp(argv[i], "--json-stats") == 0) {
+            stats_json = true;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            codec = SprayPaintCodec::Adaptive;
+        } else if (strcmp(argv[i], "--context") == 0) {
+            codec = SprayPaintCodec::Context;
+        } else if (strcmp(argv[i], "--interleaved") == 0) {
+            codec = SprayPaintCodec::Interleaved;
+        } else if (strcmp(argv[i], "--dict") == 0 && i + 1 < argc) {
+            dictionary_file = argv[++i];
+        } else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+            block_size = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.empty()) {
+        usage();
+        return 0;
+    }
+
+    auto flag = args[0];
+    if (strcmp(flag, "t") == 0) {
+        if (args.size() < 3) {
+            usage();
+            return 0;
+        }
+        try {
+            // One histogram over all the samples, read a file at a time
+            SprayPaintHistogram counts{};
+            for (size_t i = 2; i < args.size(); ++i) {
+                std::ifstream in(args[i], std::ios::binary);
+                if (!in) {
+                    throw std::runtime_error(std::string("Could not open '") + args[i] + "'");
+                }
+                std::vector<uint8_t> sample{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+                auto sample_counts = histogram(sample.data(), sample.size());
+                for (int sym = 0; sym < 256; ++sym) {
+                    counts[sym] += sample_counts[sym];
+                }
+            }
+            SprayPaintDictionary::train(counts).save(args[1]);
+        } catch (const std::exception& e) {
+            std::cerr << "spray_paint: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (strcmp(flag, "d")  != 0 && strcmp(flag, "c") != 0 && strcmp(flag, "r") != 0 && strcmp(flag, "v") != 0) {
+        usage();
+        return 0;
+    }
+
+    size_t expected_args = strcmp(flag, "r") == 0 ? 5 : strcmp(flag, "v") == 0 ? 2 : 3;
+    if (args.size() != expected_args) {
         usage();
         return 0;
     }
 
-    auto flag = argv[1];
-    auto input = argv[2];
-    auto output= argv[3];
+    auto input = args[1];
+    const char* output = args.size() > 2 ? args[2] : "";
 
-    if (strcmp(flag, "d")  != 0 && strcmp(flag, "c") != 0) {
+    // "-" reads from stdin / writes to stdout, which needs the streaming path
+    bool streaming = strcmp(input, "-") == 0 || strcmp(output, "-") == 0;
+    if (streaming && strcmp(flag, "r") == 0) {
         usage();
         return 0;
     }
 
-    SprayPaintTree tree;
-    auto spf = SprayPaintFile(std::move(tree), output, input);
+    // A dictionary is its own codec, it cannot be combined with another one
+    if (dictionary_file != nullptr && codec != SprayPaintCodec::Static) {
+        usage();
+        return 0;
+    }
 
-    if (strcmp(flag, "d") == 0) {
-        spf.read();
-    } else if (strcmp(flag, "c") == 0) {
-        spf.write();
+    if ((stats_text || stats_json) && !SPRAY_PAINT_STATS) {
+        std::cerr << "spray_paint: built without stats, --stats has no effect" << std::endl;
+        stats_text = stats_json = false;
     }
 
+    SprayPaintStats stats;
+    SprayPaintOptions options;
+    if (stats_text || stats_json) {
+        options.stats = &stats;
+    }
+    options.codec = codec;
+
+    try {
+        if (block_size != nullptr) {
+            char* end;
+            options.block_size = std::strtoull(block_size, &end, 10);
+            if (end == block_size || *end != '\0') {
+                throw std::runtime_error(std::string("Block size '") + block_size + "' is not a number of bytes.");
+            }
+        }
+        std::optional<SprayPaintDictionary> dictionary;
+        if (dictionary_file != nullptr) {
+            dictionary.emplace(SprayPaintDictionary::load(dictionary_file));
+            options.dictionary = &*dictionary;
+            options.codec = SprayPaintCodec::Dictionary;
+        }
+        auto spf = SprayPaintFile(output, input, options);
+
+        SprayPaintTimer total(options.stats, SprayPaintPhase::Total);
+        if (streaming) {
+            // cin/cout do not need to stay in step with stdio, unsynced they buffer properly
+            std::ios::sync_with_stdio(false);
+            std::ifstream in_file;
+            std::ofstream out_file;
+            if (strcmp(input, "-") != 0) {
+                in_file.open(input, std::ios::binary);
+                if (!in_file) {
+                    throw std::runtime_error(std::string("Could not open '") + input + "'");
+                }
+            }
+            if (strcmp(output, "-") != 0 && strcmp(flag, "v") != 0) {
+                out_file.open(output, std::ios::binary);
+                if (!out_file) {
+                    throw std::runtime_error(std::string("Could not open '") + output + "'");
+                }
+            }
+            std::istream& in = strcmp(input, "-") != 0 ? static_cast<std::istream&>(in_file) : std::cin;
+            std::ostream& out = strcmp(output, "-") != 0 ? static_cast<std::ostream&>(out_file) : std::cout;
+
+            auto sps = SprayPaintStream(options);
+            if (strcmp(flag, "c") == 0) {
+                sps.write(in, out);
+            } else if (strcmp(flag, "v") == 0) {
+                sps.verify(in);
+            } else {
+                sps.read(in, out);
+            }
+            out.flush();
+        } else if (strcmp(flag, "d") == 0) {
+            spf.read();
+        } else if (strcmp(flag, "c") == 0) {
+            spf.write();
+        } else if (strcmp(flag, "r") == 0) {
+            spf.read_range(std::stoull(args[3]), std::stoull(args[4]));
+        } else if (strcmp(flag, "v") == 0) {
+            spf.verify();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "spray_paint: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (strcmp(flag, "v") == 0) {
+        std::cout << input << ": OK" << std::endl;
+    }
+    if (stats_text) {
+        stats.print(std::cerr);
+    }
+    if (stats_json) {
+        stats.print_json(std::cerr);
+    }
     return 0;
 }
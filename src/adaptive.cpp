@@ -0,0 +1,191 @@
+#include "adaptive.h"
+
+#include <algorithm>
+
+SprayPaintAdaptiveTree::SprayPaintAdaptiveTree() {
+    this->leaf_.fill(kNone);
+    this->nyt_ = this->add_leaf(kMaxNodes - 1, 0);
+    this->nodes_[this->nyt_].parent = kNone;
+}
+
+uint16_t SprayPaintAdaptiveTree::add_leaf(uint16_t position, uint8_t symbol) {
+    auto node = this->node_count_++;
+    this->nodes_[node] = Node{0, kNone, {kNone, kNone}, 0, symbol, true};
+    this->position_[node] = position;
+    this->node_at_[position] = node;
+    return node;
+}
+
+void SprayPaintAdaptiveTree::place(uint16_t node, uint16_t position, Slot slot) {
+    auto& nd = this->nodes_[node];
+    nd.parent = slot.parent;
+    nd.side = slot.side;
+    if (slot.parent != kNone) {
+        this->nodes_[slot.parent].child[slot.side] = node;
+    }
+    this->position_[node] = position;
+    this->node_at_[position] = node;
+}
+
+uint16_t SprayPaintAdaptiveTree::leader(uint16_t node) const {
+    const auto& nd = this->nodes_[node];
+    size_t pos = this->position_[node];
+    while (pos + 1 < kMaxNodes) {
+        const auto& next = this->nodes_[this->node_at_[pos + 1]];
+        if (next.weight != nd.weight || next.leaf != nd.leaf) {
+            break;
+        }
+        ++pos;
+    }
+    return this->node_at_[pos];
+}
+
+void SprayPaintAdaptiveTree::swap_nodes(uint16_t a, uint16_t b) {
+    if (a == b) {
+        return;
+    }
+    auto slot_a = this->slot(a);
+    auto slot_b = this->slot(b);
+    auto pos_a = this->position_[a];
+    auto pos_b = this->position_[b];
+    this->place(a, pos_b, slot_b);
+    this->place(b, pos_a, slot_a);
+}
+
+uint16_t SprayPaintAdaptiveTree::slide_and_increment(uint16_t node) {
+    auto& nd = this->nodes_[node];
+    auto weight = nd.weight;
+    auto former_parent = nd.parent;
+
+    // A leaf slides past the internal nodes of its own weight, an internal node
+    // past the leaves one heavier than it, so the order stays intact once it is
+    // incremented.
+    size_t start = this->position_[node];
+    auto end = start;
+    while (end + 1 < kMaxNodes) {
+        const auto& next = this->nodes_[this->node_at_[end + 1]];
+        if (nd.leaf ? (next.leaf || next.weight != weight) : (!next.leaf || next.weight != weight + 1)) {
+            break;
+        }
+        ++end;
+    }
+
+    if (end != start) {
+        // Every node in the block shifts down one position, taking the slot of
+        // the one before it, and node takes the last slot.
+        auto carry = this->slot(node);
+        for (auto pos = start; pos < end; ++pos) {
+            auto moving = this->node_at_[pos + 1];
+            auto next = this->slot(moving);
+            this->place(moving, static_cast<uint16_t>(pos), carry);
+            carry = next;
+        }
+        this->place(node, static_cast<uint16_t>(end), carry);
+    }
+
+    ++nd.weight;
+    return nd.leaf ? nd.parent : former_parent;
+}
+
+void SprayPaintAdaptiveTree::update(uint8_t symbol) {
+    auto leaf_to_increment = kNone;
+    auto node = this->leaf_[symbol];
+
+    if (node == kNone) {
+        // The NYT leaf becomes an internal node over a new NYT (left) and the new symbol (right)
+        auto parent = this->nyt_;
+        auto pos = this->position_[parent];
+        auto leaf = this->add_leaf(pos - 1, symbol);
+        auto nyt = this->add_leaf(pos - 2, 0);
+        this->nodes_[parent].leaf = false;
+        this->place(nyt, pos - 2, {parent, 0});
+        this->place(leaf, pos - 1, {parent, 1});
+        this->nyt_ = nyt;
+        this->leaf_[symbol] = leaf;
+
+        node = parent;
+        leaf_to_increment = leaf;
+    } else {
+        this->swap_nodes(node, this->leader(node));
+
+        // Incrementing a leaf next to the NYT first would put it above its own parent
+        auto parent = this->nodes_[node].parent;
+        if (parent != kNone && this->nodes_[parent].child[0] == this->nyt_) {
+            leaf_to_increment = node;
+            node = parent;
+        }
+    }
+
+    while (node != kNone) {
+        node = this->slide_and_increment(node);
+    }
+    if (leaf_to_increment != kNone) {
+        this->slide_and_increment(leaf_to_increment);
+    }
+}
+
+void SprayPaintAdaptiveTree::encode(uint8_t symbol, BitWriter& writer) {
+    auto node = this->leaf_[symbol];
+    bool is_new = node == kNone;
+    if (is_new) {
+        node = this->nyt_;
+    }
+
+    // Collect the path leaf to root, then send it root first
+    std::array<uint8_t, kMaxNodes> path;
+    size_t depth = 0;
+    for (; this->nodes_[node].parent != kNone; node = this->nodes_[node].parent) {
+        path[depth++] = this->nodes_[node].side;
+    }
+    while (depth > 0) {
+        auto n = std::min<size_t>(depth, 32);
+        uint64_t bits = 0;
+        for (size_t i = 0; i < n; ++i) {
+            bits = (bits << 1) | path[--depth];
+        }
+        writer.write(bits, static_cast<unsigned>(n));
+    }
+
+    if (is_new) {
+        writer.write(symbol, 8);
+    }
+    this->update(symbol);
+}
+
+bool SprayPaintAdaptiveTree::decode(BitReader& reader, uint8_t& symbol) {
+    auto node = this->node_at_[kMaxNodes - 1];
+    while (!this->nodes_[node].leaf) {
+        if (reader.remaining() == 0) {
+            return false;
+        }
+        node = this->nodes_[node].child[reader.peek(1)];
+        reader.consume(1);
+    }
+
+    if (node == this->nyt_) {
+        if (reader.remaining() < 8) {
+            return false;
+        }
+        symbol = static_cast<uint8_t>(reader.peek(8));
+        reader.consume(8);
+    } else {
+        symbol = this->nodes_[node].symbol;
+    }
+    this->update(symbol);
+    return true;
+}
+
+size_t SprayPaintAdaptiveTree::depth() const {
+    size_t deepest = 0;
+    for (uint16_t node = 0; node < this->node_count_; ++node) {
+        if (!this->nodes_[node].leaf) {
+            continue;
+        }
+        size_t d = 0;
+        for (auto n = node; this->nodes_[n].parent != kNone; n = this->nodes_[n].parent) {
+            ++d;
+        }
+        deepest = std::max(deepest, d + (node == this->nyt_ ? 8 : 0));
+    }
+    return deepest;
+}
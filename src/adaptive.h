@@ -0,0 +1,96 @@
+#pragma once
+
+#include "bitstream.h"
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+/* SprayPaintAdaptiveTree is a one pass (dynamic) huffman code using Vitter's
+ * algorithm Lambda. The encoder and decoder start from the same tree holding a
+ * single "not yet transmitted" (NYT) leaf and update it identically after every
+ * symbol, so no code lengths are ever stored and the first code goes out
+ * before the rest of the input has been seen.
+ *
+ * A symbol seen before is sent as its current code. A new symbol is sent as
+ * the NYT code followed by its 8 bit value, after which the NYT leaf splits
+ * into a new NYT leaf and a leaf for the symbol.
+ *
+ * Nodes live in a fixed arena like SprayPaintTree. Vitter's implicit numbering
+ * is kept as a position <-> node mapping: positions increase with weight and,
+ * within a weight, leaves come before internal nodes. A "block" is a run of
+ * positions with the same weight and kind, and its leader is the highest one.*/
+class SprayPaintAdaptiveTree {
+public:
+    SprayPaintAdaptiveTree();
+
+    // Writes the current code for symbol and updates the tree.
+    void encode(uint8_t symbol, BitWriter& writer);
+
+    // Reads one symbol and updates the tree. Returns false if the reader runs
+    // out of bits first.
+    bool decode(BitReader& reader, uint8_t& symbol);
+
+    // Longest code, in bits, a symbol could be sent with right now.
+    [[nodiscard]] size_t depth() const;
+private:
+    // 256 symbol leaves, the NYT leaf and the internal nodes joining them.
+    static constexpr size_t kMaxNodes = 2 * 257 - 1;
+
+    static constexpr uint16_t kNone = 0xFFFF;
+
+    struct Node {
+        uint64_t weight;
+
+        uint16_t parent;
+
+        uint16_t child[2];
+
+        // Which child of its parent this node is.
+        uint8_t side;
+
+        uint8_t symbol;
+
+        bool leaf;
+    };
+
+    // Where a node hangs in the tree: its parent and which side.
+    struct Slot {
+        uint16_t parent;
+
+        uint8_t side;
+    };
+
+    uint16_t add_leaf(uint16_t position, uint8_t symbol);
+
+    void place(uint16_t node, uint16_t position, Slot slot);
+
+    [[nodiscard]] Slot slot(uint16_t node) const {
+        return {this->nodes_[node].parent, this->nodes_[node].side};
+    }
+
+    // Highest position in the block holding node.
+    [[nodiscard]] uint16_t leader(uint16_t node) const;
+
+    void swap_nodes(uint16_t a, uint16_t b);
+
+    // Moves node past the block following it when Vitter's invariant calls for
+    // it, increments its weight and returns the next node to process.
+    uint16_t slide_and_increment(uint16_t node);
+
+    void update(uint8_t symbol);
+
+    std::array<Node, kMaxNodes> nodes_{};
+
+    // position_[node] and node_at_[position] are inverses. The root is always
+    // at kMaxNodes - 1 and new nodes take the positions below the lowest in use.
+    std::array<uint16_t, kMaxNodes> position_{};
+
+    std::array<uint16_t, kMaxNodes> node_at_{};
+
+    std::array<uint16_t, 256> leaf_{};
+
+    uint16_t nyt_;
+
+    uint16_t node_count_ = 0;
+};
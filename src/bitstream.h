@@ -0,0 +1,172 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Loads 8 bytes starting at p as a big endian word. Codes are stored MSB first
+// so this lines the next bits of the stream up at the top of the word.
+inline uint64_t load_be64(const uint8_t* p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    if constexpr (std::endian::native == std::endian::little) {
+        word = std::byteswap(word);
+    }
+    return word;
+}
+
+inline void store_be32(uint8_t* p, uint32_t word) {
+    if constexpr (std::endian::native == std::endian::little) {
+        word = std::byteswap(word);
+    }
+    std::memcpy(p, &word, sizeof(word));
+}
+
+inline void store_le32(uint8_t* p, uint32_t value) {
+    if constexpr (std::endian::native == std::endian::big) {
+        value = std::byteswap(value);
+    }
+    std::memcpy(p, &value, sizeof(value));
+}
+
+inline uint32_t load_le32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    if constexpr (std::endian::native == std::endian::big) {
+        value = std::byteswap(value);
+    }
+    return value;
+}
+
+inline void store_le64(uint8_t* p, uint64_t value) {
+    if constexpr (std::endian::native == std::endian::big) {
+        value = std::byteswap(value);
+    }
+    std::memcpy(p, &value, sizeof(value));
+}
+
+inline uint64_t load_le64(const uint8_t* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    if constexpr (std::endian::native == std::endian::big) {
+        value = std::byteswap(value);
+    }
+    return value;
+}
+
+/* BitReader is a cursor over an MSB first bitstream held in memory.
+ * peek() always does a single unaligned 64 bit load (except for the last
+ * few bytes of the buffer) so looking at the next N bits is a load, a shift
+ * and a mask rather than a loop over individual bits.*/
+class BitReader {
+public:
+    BitReader(const uint8_t* data, size_t bits)
+            : data_(data), bytes_((bits + 7) / 8), bits_(bits), pos_(0) {}
+
+    // Returns the next n bits (1 <= n <= 56) without consuming them.
+    // Bits past the end of the buffer read as 0.
+    [[nodiscard]] uint64_t peek(unsigned n) const {
+        size_t byte = this->pos_ >> 3;
+        uint64_t word;
+        if (byte + 8 <= this->bytes_) {
+            word = load_be64(this->data_ + byte);
+        } else {
+            word = 0;
+            for (size_t i = 0; i < 8; ++i) {
+                word <<= 8;
+                if (byte + i < this->bytes_) {
+                    word |= this->data_[byte + i];
+                }
+            }
+        }
+        return (word << (this->pos_ & 7)) >> (64 - n);
+    }
+
+    void consume(unsigned n) {
+        this->pos_ += n;
+    }
+
+    [[nodiscard]] size_t remaining() const {
+        return this->pos_ >= this->bits_ ? 0 : this->bits_ - this->pos_;
+    }
+
+    [[nodiscard]] size_t position() const {
+        return this->pos_;
+    }
+private:
+    const uint8_t* data_;
+
+    size_t bytes_;
+
+    size_t bits_;
+
+    size_t pos_;
+};
+
+/* BitWriter packs codes MSB first into a 64 bit accumulator and stores whole
+ * 32 bit words into a caller supplied buffer, so appending a code is a shift,
+ * an or and (every few symbols) a single 4 byte store.
+ *
+ * The caller is responsible for sizing the buffer: every write() can add up to
+ * ceil(length / 8) bytes, and flush() adds at most 8 more.*/
+class BitWriter {
+public:
+    BitWriter(uint8_t* dst, size_t capacity)
+            : dst_(dst), capacity_(capacity), pos_(0), acc_(0), bits_(0) {}
+
+    // Appends the low `length` bits of `code`, most significant bit first.
+    void write(uint64_t code, unsigned length) {
+        if (length > 32) [[unlikely]] {
+            this->write(code >> 32, length - 32);
+            code &= 0xFFFFFFFF;
+            length = 32;
+        }
+
+        // bits_ < 32 on entry so the accumulator never holds more than 63 bits
+        this->acc_ = (this->acc_ << length) | code;
+        this->bits_ += length;
+        if (this->bits_ >= 32) {
+            this->bits_ -= 32;
+            store_be32(this->dst_ + this->pos_, static_cast<uint32_t>(this->acc_ >> this->bits_));
+            this->pos_ += 4;
+        }
+    }
+
+    // Writes out any bits still in the accumulator, padding the last byte with 0's.
+    void flush() {
+        while (this->bits_ >= 8) {
+            this->bits_ -= 8;
+            this->dst_[this->pos_++] = static_cast<uint8_t>(this->acc_ >> this->bits_);
+        }
+        if (this->bits_ > 0) {
+            this->dst_[this->pos_++] = static_cast<uint8_t>(this->acc_ << (8 - this->bits_));
+            this->bits_ = 0;
+        }
+    }
+
+    // Number of bytes stored in the buffer so far.
+    [[nodiscard]] size_t bytes() const {
+        return this->pos_;
+    }
+
+    [[nodiscard]] size_t capacity() const {
+        return this->capacity_;
+    }
+
+    // Called once the caller has consumed bytes() bytes from the buffer. Bits
+    // still in the accumulator are kept and land at the start of the buffer.
+    void rewind() {
+        this->pos_ = 0;
+    }
+private:
+    uint8_t* dst_;
+
+    size_t capacity_;
+
+    size_t pos_;
+
+    uint64_t acc_;
+
+    unsigned bits_;
+};
@@ -0,0 +1,1100 @@
+#include "block.h"
+#include "adaptive.h"
+#include "bitstream.h"
+#include "checksum.h"
+#include "context.h"
+#include "decoder.h"
+#include "dictionary.h"
+#include "huffman.h"
+#include "package_merge.h"
+#include "scratch.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+
+void write_file_header(uint8_t* dst, const SprayPaintFileHeader& header) {
+    std::memcpy(dst, kSprayPaintMagic, sizeof(kSprayPaintMagic));
+    dst[sizeof(kSprayPaintMagic)] = kSprayPaintVersion;
+    store_le32(dst + sizeof(kSprayPaintMagic) + 1, header.flags);
+    store_le32(dst + sizeof(kSprayPaintMagic) + 5, header.block_size);
+    dst[sizeof(kSprayPaintMagic) + 9] = header.max_code_length;
+    store_le32(dst + sizeof(kSprayPaintMagic) + 10, header.dictionary);
+}
+
+SprayPaintFileHeader read_file_header(const uint8_t* src, size_t size) {
+    if (size < kSprayPaintFileHeaderSize || std::memcmp(src, kSprayPaintMagic, sizeof(kSprayPaintMagic)) != 0) {
+        throw std::runtime_error("Input is not a spray paint file.");
+    }
+    if (src[sizeof(kSprayPaintMagic)] != kSprayPaintVersion) {
+        throw std::runtime_error("Unsupported spray paint file version.");
+    }
+
+    SprayPaintFileHeader header{};
+    header.flags = load_le32(src + sizeof(kSprayPaintMagic) + 1);
+    header.block_size = load_le32(src + sizeof(kSprayPaintMagic) + 5);
+    if (header.block_size == 0 || header.block_size > kMaxBlockSize) {
+        throw std::runtime_error("File header has an invalid block size.");
+    }
+    header.max_code_length = src[sizeof(kSprayPaintMagic) + 9];
+    if (header.max_code_length < kMinCodeLengthLimit || header.max_code_length > kMaxCodeLength) {
+        throw std::runtime_error("File header has an invalid max code length.");
+    }
+    header.dictionary = load_le32(src + sizeof(kSprayPaintMagic) + 10);
+    return header;
+}
+
+void write_block_header(uint8_t* dst, const SprayPaintBlockHeader& header) {
+    dst[0] = static_cast<uint8_t>(header.type);
+    store_le32(dst + 1, header.raw_size);
+    store_le32(dst + 5, header.payload_size);
+    store_le32(dst + 9, header.checksum);
+}
+
+SprayPaintBlockHeader read_block_header(const uint8_t* src) {
+    SprayPaintBlockHeader header{};
+    header.type = static_cast<SprayPaintBlockType>(src[0]);
+    header.raw_size = load_le32(src + 1);
+    header.payload_size = load_le32(src + 5);
+    header.checksum = load_le32(src + 9);
+    return header;
+}
+
+static void check_capacity(size_t block_size, size_t capacity) {
+    if (block_size > capacity) {
+        throw std::runtime_error("Output buffer is too small for the compressed block.");
+    }
+}
+
+// Runs `compress` on a buffer sized for the worst case and trims it to fit.
+template <typename F>
+static std::vector<uint8_t> compress_to_vector(size_t bound, F&& compress) {
+    std::vector<uint8_t> block(bound);
+    block.resize(compress(block.data(), block.size()));
+    return block;
+}
+
+static uint32_t block_checksum(const uint8_t* data, size_t size, SprayPaintStats* stats) {
+    SprayPaintTimer timer(stats, SprayPaintPhase::Checksum);
+    return crc32c(data, size);
+}
+
+SprayPaintCodeLengths build_code_lengths(const SprayPaintHistogram& counts, unsigned max_code_length) {
+    SprayPaintTree tree;
+    tree.register_charset(counts);
+    tree.build();
+    auto lengths = tree.code_lengths();
+    if (longest_code(lengths) > max_code_length) {
+        lengths = package_merge(counts, max_code_length);
+    }
+    return lengths;
+}
+
+static uint64_t coded_bits(const SprayPaintHistogram& counts, const SprayPaintCodeLengths& lengths) {
+    uint64_t total_bits = 0;
+    for (int sym = 0; sym < 256; ++sym) {
+        total_bits += counts[sym] * lengths[sym];
+    }
+    return total_bits;
+}
+
+// A code length header is at least a nibble per byte value.
+constexpr size_t kMinCodeLengthsSize = 256 / 2;
+
+/* No prefix code gets below the order-0 entropy of its input, so when that
+ * plus `overhead` bytes the block spends before its data already reaches
+ * `size`, the block cannot shrink and the tree is not worth building. This
+ * catches compressed and random data straight off the histogram.*/
+static bool cannot_shrink(const SprayPaintHistogram& counts, size_t size, size_t overhead) {
+    double bits = 0;
+    for (auto count : counts) {
+        if (count != 0) {
+            bits += static_cast<double>(count) * std::log2(static_cast<double>(size) / static_cast<double>(count));
+        }
+    }
+    return static_cast<double>(overhead) + bits / 8 >= static_cast<double>(size);
+}
+
+// Stored payload is the raw bytes, decoded with a memcpy.
+static size_t write_stored_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                                 SprayPaintStats* stats) {
+    auto block_size = kBlockHeaderSize + size;
+    check_capacity(block_size, capacity);
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Stored,
+                                 static_cast<uint32_t>(size),
+                                 static_cast<uint32_t>(size),
+                                 block_checksum(src, size, stats)});
+    }
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+        std::memcpy(dst + kBlockHeaderSize, src, size);
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::StoredBlocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, size * uint64_t{8});
+    return block_size;
+}
+
+// Run lengths are stored minus one as LEB128 varints, 7 bits per byte.
+static size_t varint_size(uint32_t value) {
+    size_t bytes = 1;
+    for (; value >= 0x80; value >>= 7) {
+        ++bytes;
+    }
+    return bytes;
+}
+
+static size_t write_varint(uint8_t* dst, uint32_t value) {
+    size_t bytes = 0;
+    for (; value >= 0x80; value >>= 7) {
+        dst[bytes++] = static_cast<uint8_t>(value | 0x80);
+    }
+    dst[bytes++] = static_cast<uint8_t>(value);
+    return bytes;
+}
+
+// Length of the run of src[0] at the start of src. Eight bytes at a time, so
+// long runs go by at memory speed.
+static size_t run_length(const uint8_t* src, size_t size) {
+    auto pattern = src[0] * uint64_t{0x0101010101010101};
+    size_t length = 1;
+    while (length + 8 <= size && load_le64(src + length) == pattern) {
+        length += 8;
+    }
+    while (length < size && src[length] == src[0]) {
+        ++length;
+    }
+    return length;
+}
+
+/* Every code the coders here hand out is at least a bit long, so when listing
+ * a block's runs takes fewer than size / 8 bytes the Run block is smaller than
+ * any of them could make it, without building a tree or coding a bit. A block
+ * of one repeated byte comes down to a few bytes. The scan gives up as soon as
+ * the runs reach that limit, so blocks without long runs pay for a sixteenth
+ * of a pass at most. Returns 0, having written nothing, when runs do not pay.*/
+static size_t try_run_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, SprayPaintStats* stats) {
+    auto limit = size / 8;
+    size_t payload_size = 0;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Histogram);
+        for (size_t i = 0; i < size && payload_size < limit;) {
+            auto length = run_length(src + i, size - i);
+            payload_size += 1 + varint_size(static_cast<uint32_t>(length - 1));
+            i += length;
+        }
+    }
+    if (payload_size >= limit) {
+        return 0;
+    }
+
+    auto block_size = kBlockHeaderSize + payload_size;
+    check_capacity(block_size, capacity);
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Run,
+                                 static_cast<uint32_t>(size),
+                                 static_cast<uint32_t>(payload_size),
+                                 block_checksum(src, size, stats)});
+    }
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+        auto* p = dst + kBlockHeaderSize;
+        for (size_t i = 0; i < size;) {
+            auto length = run_length(src + i, size - i);
+            *p++ = src[i];
+            p += write_varint(p, static_cast<uint32_t>(length - 1));
+            i += length;
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::RunBlocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, payload_size * uint64_t{8});
+    return block_size;
+}
+
+/* The code lengths give the exact payload size before anything is encoded, so
+ * the capacity is checked once up front and the BitWriter stores straight
+ * into dst.*/
+static size_t write_huffman_block(const uint8_t* src, size_t size, const SprayPaintHistogram& counts,
+                                  const SprayPaintCodeLengths& lengths, uint8_t* dst, size_t capacity,
+                                  SprayPaintStats* stats) {
+    auto codes = canonical_codes(lengths);
+    auto total_bits = coded_bits(counts, lengths);
+
+    auto lengths_size = code_lengths_size(lengths);
+    auto payload_size = lengths_size + (total_bits + 7) / 8;
+    if (payload_size >= size) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+    auto block_size = kBlockHeaderSize + payload_size;
+    check_capacity(block_size, capacity);
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Huffman,
+                                          static_cast<uint32_t>(size),
+                                          static_cast<uint32_t>(payload_size),
+                                          block_checksum(src, size, stats)});
+        write_code_lengths(dst + kBlockHeaderSize, lengths);
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+        auto data_start = kBlockHeaderSize + lengths_size;
+        auto writer = BitWriter(dst + data_start, block_size - data_start);
+        for (size_t i = 0; i < size; ++i) {
+            const auto& code = codes[src[i]];
+            writer.write(code.bits, code.length);
+        }
+        writer.flush();
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, total_bits);
+    record_code_length(stats, longest_code(lengths));
+    return block_size;
+}
+
+// Each block gets its own histogram and tree.
+size_t compress_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, unsigned max_code_length,
+                      SprayPaintStats* stats) {
+    if (size == 0 || size > kMaxBlockSize) {
+        throw std::runtime_error("Block size must be between 1 byte and kMaxBlockSize.");
+    }
+    if (auto block_size = try_run_block(src, size, dst, capacity, stats); block_size != 0) {
+        return block_size;
+    }
+
+    SprayPaintHistogram counts;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Histogram);
+        counts = histogram(src, size);
+    }
+    if (cannot_shrink(counts, size, kMinCodeLengthsSize)) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+
+    SprayPaintCodeLengths lengths;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::TreeBuild);
+        lengths = build_code_lengths(counts, max_code_length);
+    }
+    return write_huffman_block(src, size, counts, lengths, dst, capacity, stats);
+}
+
+std::vector<uint8_t> compress_block(const uint8_t* src, size_t size, unsigned max_code_length, SprayPaintStats* stats) {
+    auto bound = max_compressed_block_size(size);
+    return compress_to_vector(bound, [&](uint8_t* dst, size_t capacity) {
+        return compress_block(src, size, dst, capacity, max_code_length, stats);
+    });
+}
+
+/* Interleaved payload: code lengths, the byte size of each stream but the last
+ * (u32 each), then the streams back to back. Stream s codes input bytes
+ * [s * size / 4, (s + 1) * size / 4) and starts on a byte boundary, so the
+ * decoder can point a cursor at every stream up front.*/
+static_assert(kInterleavedStreams == kDecodeStreams);
+
+static size_t stream_start(size_t size, size_t stream) {
+    return size * stream / kInterleavedStreams;
+}
+
+size_t compress_interleaved_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                                  unsigned max_code_length, SprayPaintStats* stats) {
+    if (size == 0 || size > kMaxBlockSize) {
+        throw std::runtime_error("Block size must be between 1 byte and kMaxBlockSize.");
+    }
+    if (auto block_size = try_run_block(src, size, dst, capacity, stats); block_size != 0) {
+        return block_size;
+    }
+
+    // One histogram per stream gives every stream's exact size, and their sum the block's
+    std::array<SprayPaintHistogram, kInterleavedStreams> counts;
+    SprayPaintHistogram total{};
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Histogram);
+        for (size_t s = 0; s < kInterleavedStreams; ++s) {
+            counts[s] = histogram(src + stream_start(size, s), stream_start(size, s + 1) - stream_start(size, s));
+            for (int sym = 0; sym < 256; ++sym) {
+                total[sym] += counts[s][sym];
+            }
+        }
+    }
+    if (cannot_shrink(total, size, kMinCodeLengthsSize + kJumpTableSize)) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+
+    SprayPaintCodeLengths lengths;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::TreeBuild);
+        lengths = build_code_lengths(total, max_code_length);
+    }
+    auto codes = canonical_codes(lengths);
+
+    std::array<size_t, kInterleavedStreams> stream_size;
+    auto lengths_size = code_lengths_size(lengths);
+    auto payload_size = lengths_size + kJumpTableSize;
+    for (size_t s = 0; s < kInterleavedStreams; ++s) {
+        stream_size[s] = (coded_bits(counts[s], lengths) + 7) / 8;
+        payload_size += stream_size[s];
+    }
+    if (payload_size >= size) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+
+    auto block_size = kBlockHeaderSize + payload_size;
+    check_capacity(block_size, capacity);
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Interleaved,
+                                 static_cast<uint32_t>(size),
+                                 static_cast<uint32_t>(payload_size),
+                                 block_checksum(src, size, stats)});
+        auto* p = dst + kBlockHeaderSize;
+        p += write_code_lengths(p, lengths);
+        for (size_t s = 0; s + 1 < kInterleavedStreams; ++s) {
+            store_le32(p + 4 * s, static_cast<uint32_t>(stream_size[s]));
+        }
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+
+        // Encoding has no dependency between symbols to hide, so the streams
+        // simply go one after the other
+        auto* p = dst + kBlockHeaderSize + lengths_size + kJumpTableSize;
+        for (size_t s = 0; s < kInterleavedStreams; ++s) {
+            auto writer = BitWriter(p, stream_size[s]);
+            for (auto i = stream_start(size, s); i < stream_start(size, s + 1); ++i) {
+                const auto& code = codes[src[i]];
+                writer.write(code.bits, code.length);
+            }
+            writer.flush();
+            p += stream_size[s];
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, coded_bits(total, lengths));
+    record_code_length(stats, longest_code(lengths));
+    return block_size;
+}
+
+std::vector<uint8_t> compress_interleaved_block(const uint8_t* src, size_t size, unsigned max_code_length,
+                                                SprayPaintStats* stats) {
+    auto bound = max_compressed_block_size(size);
+    return compress_to_vector(bound, [&](uint8_t* dst, size_t capacity) {
+        return compress_interleaved_block(src, size, dst, capacity, max_code_length, stats);
+    });
+}
+
+/* Context payload: cluster count (u8), the cluster of every previous byte
+ * value as 128 bytes of nibbles (high nibble first), one code length header
+ * per cluster, then the data. Each byte is coded with the cluster of the byte
+ * before it, 0 for the first byte of the block.
+ *
+ * Clustering can decide order-1 is not worth it (few clusters, or tables that
+ * cost more than they save). The block then goes out as a plain Huffman block,
+ * whichever is smaller.*/
+constexpr size_t kContextMapSize = 128;
+
+size_t compress_context_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                              unsigned max_code_length, SprayPaintStats* stats, SprayPaintBlockScratch* scratch) {
+    if (size == 0 || size > kMaxBlockSize) {
+        throw std::runtime_error("Block size must be between 1 byte and kMaxBlockSize.");
+    }
+    if (auto block_size = try_run_block(src, size, dst, capacity, stats); block_size != 0) {
+        return block_size;
+    }
+
+    std::unique_ptr<SprayPaintContextScratch> owned;
+    auto& context = [&]() -> SprayPaintContextScratch& {
+        auto& slot = scratch != nullptr ? scratch->context : owned;
+        if (!slot) {
+            slot = std::make_unique<SprayPaintContextScratch>();
+        }
+        return *slot;
+    }();
+    const auto& clusters = context.clusters;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Histogram);
+        context_histogram(src, size, context.counts);
+    }
+
+    std::array<SprayPaintCodeLengths, kMaxContextClusters> lengths;
+    SprayPaintHistogram order0{};
+    SprayPaintCodeLengths order0_lengths;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::TreeBuild);
+        cluster_contexts(context.counts, context.clusters, context.sparse);
+        for (size_t k = 0; k < clusters.histograms.size(); ++k) {
+            lengths[k] = build_code_lengths(clusters.histograms[k], max_code_length);
+            for (int sym = 0; sym < 256; ++sym) {
+                order0[sym] += clusters.histograms[k][sym];
+            }
+        }
+        order0_lengths = build_code_lengths(order0, max_code_length);
+    }
+
+    uint64_t total_bits = 0;
+    size_t header_size = 1 + kContextMapSize;
+    uint8_t longest = 0;
+    for (size_t k = 0; k < clusters.histograms.size(); ++k) {
+        total_bits += coded_bits(clusters.histograms[k], lengths[k]);
+        header_size += code_lengths_size(lengths[k]);
+        longest = std::max(longest, longest_code(lengths[k]));
+    }
+    auto payload_size = header_size + (total_bits + 7) / 8;
+    if (payload_size >= code_lengths_size(order0_lengths) + (coded_bits(order0, order0_lengths) + 7) / 8) {
+        return write_huffman_block(src, size, order0, order0_lengths, dst, capacity, stats);
+    }
+    if (payload_size >= size) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+
+    auto block_size = kBlockHeaderSize + payload_size;
+    check_capacity(block_size, capacity);
+    std::array<SprayPaintCodeTable, kMaxContextClusters> codes;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Context,
+                                 static_cast<uint32_t>(size),
+                                 static_cast<uint32_t>(payload_size),
+                                 block_checksum(src, size, stats)});
+        auto* p = dst + kBlockHeaderSize;
+        *p++ = static_cast<uint8_t>(clusters.histograms.size());
+        for (size_t ctx = 0; ctx < 256; ctx += 2) {
+            *p++ = static_cast<uint8_t>(clusters.map[ctx] << 4 | clusters.map[ctx + 1]);
+        }
+        for (size_t k = 0; k < clusters.histograms.size(); ++k) {
+            p += write_code_lengths(p, lengths[k]);
+            codes[k] = canonical_codes(lengths[k]);
+        }
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+
+        // Straight from the previous byte to its cluster's code table
+        std::array<const SprayPaintCode*, 256> tables;
+        for (size_t ctx = 0; ctx < 256; ++ctx) {
+            tables[ctx] = codes[clusters.map[ctx]].data();
+        }
+
+        auto data_start = kBlockHeaderSize + header_size;
+        auto writer = BitWriter(dst + data_start, block_size - data_start);
+        uint8_t prev = 0;
+        for (size_t i = 0; i < size; ++i) {
+            const auto& code = tables[prev][src[i]];
+            writer.write(code.bits, code.length);
+            prev = src[i];
+        }
+        writer.flush();
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, total_bits);
+    record_code_length(stats, longest);
+    return block_size;
+}
+
+std::vector<uint8_t> compress_context_block(const uint8_t* src, size_t size, unsigned max_code_length,
+                                            SprayPaintStats* stats) {
+    auto bound = max_compressed_block_size(size);
+    return compress_to_vector(bound, [&](uint8_t* dst, size_t capacity) {
+        return compress_context_block(src, size, dst, capacity, max_code_length, stats);
+    });
+}
+
+// The adaptive bitstream is written in small chunks and copied into the block,
+// since its size is not known until the last symbol is coded. A single symbol
+// takes at most one bit per tree level plus 8, far less than the slack.
+constexpr size_t kAdaptiveChunkSize = 4096;
+
+constexpr size_t kAdaptiveChunkSlack = 128;
+
+/* The histogram gives the exact size of both the Dictionary block and the
+ * block's own Huffman codes before anything is encoded, so picking the smaller
+ * one costs a tree build and no trial encode.*/
+size_t compress_dictionary_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                                 const SprayPaintDictionary& dictionary, unsigned max_code_length,
+                                 SprayPaintStats* stats) {
+    if (size == 0 || size > kMaxBlockSize) {
+        throw std::runtime_error("Block size must be between 1 byte and kMaxBlockSize.");
+    }
+    if (auto block_size = try_run_block(src, size, dst, capacity, stats); block_size != 0) {
+        return block_size;
+    }
+
+    SprayPaintHistogram counts;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Histogram);
+        counts = histogram(src, size);
+    }
+    if (cannot_shrink(counts, size, 0)) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+
+    SprayPaintCodeLengths lengths;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::TreeBuild);
+        lengths = build_code_lengths(counts, max_code_length);
+    }
+
+    const auto& shared = dictionary.lengths();
+    bool codable = true;
+    for (int sym = 0; sym < 256; ++sym) {
+        codable &= counts[sym] == 0 || shared[sym] != 0;
+    }
+    auto total_bits = coded_bits(counts, shared);
+    auto payload_size = (total_bits + 7) / 8;
+    if (!codable || payload_size >= code_lengths_size(lengths) + (coded_bits(counts, lengths) + 7) / 8) {
+        return write_huffman_block(src, size, counts, lengths, dst, capacity, stats);
+    }
+    if (payload_size >= size) {
+        return write_stored_block(src, size, dst, capacity, stats);
+    }
+
+    auto block_size = kBlockHeaderSize + payload_size;
+    check_capacity(block_size, capacity);
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Dictionary,
+                                 static_cast<uint32_t>(size),
+                                 static_cast<uint32_t>(payload_size),
+                                 block_checksum(src, size, stats)});
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+        const auto& codes = dictionary.codes();
+        auto writer = BitWriter(dst + kBlockHeaderSize, payload_size);
+        for (size_t i = 0; i < size; ++i) {
+            const auto& code = codes[src[i]];
+            writer.write(code.bits, code.length);
+        }
+        writer.flush();
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, total_bits);
+    record_code_length(stats, longest_code(shared));
+    return block_size;
+}
+
+size_t compress_adaptive_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, SprayPaintStats* stats) {
+    if (size == 0 || size > kMaxBlockSize) {
+        throw std::runtime_error("Block size must be between 1 byte and kMaxBlockSize.");
+    }
+    if (auto block_size = try_run_block(src, size, dst, capacity, stats); block_size != 0) {
+        return block_size;
+    }
+
+    // There is no size to check up front, coding stops as soon as the payload
+    // catches up with the input and the block is stored instead
+    auto block_size = kBlockHeaderSize;
+    check_capacity(block_size, capacity);
+    size_t depth;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Encode);
+        SprayPaintAdaptiveTree tree;
+        std::array<uint8_t, kAdaptiveChunkSize> chunk;
+        auto writer = BitWriter(chunk.data(), chunk.size());
+        auto append = [&] {
+            if (block_size + writer.bytes() >= kBlockHeaderSize + size) {
+                return false;
+            }
+            check_capacity(block_size + writer.bytes(), capacity);
+            std::memcpy(dst + block_size, chunk.data(), writer.bytes());
+            block_size += writer.bytes();
+            writer.rewind();
+            return true;
+        };
+        for (size_t i = 0; i < size; ++i) {
+            tree.encode(src[i], writer);
+            if (writer.bytes() > chunk.size() - kAdaptiveChunkSlack && !append()) {
+                return write_stored_block(src, size, dst, capacity, stats);
+            }
+        }
+        writer.flush();
+        if (!append()) {
+            return write_stored_block(src, size, dst, capacity, stats);
+        }
+        depth = tree.depth();
+    }
+
+    auto payload_size = block_size - kBlockHeaderSize;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        write_block_header(dst, {SprayPaintBlockType::Adaptive,
+                                 static_cast<uint32_t>(size),
+                                 static_cast<uint32_t>(payload_size),
+                                 block_checksum(src, size, stats)});
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, size);
+    record(stats, SprayPaintCounter::BytesOut, block_size);
+    record(stats, SprayPaintCounter::Symbols, size);
+    record(stats, SprayPaintCounter::Bits, payload_size * uint64_t{8});
+    record_code_length(stats, depth);
+    return block_size;
+}
+
+std::vector<uint8_t> compress_adaptive_block(const uint8_t* src, size_t size, SprayPaintStats* stats) {
+    auto bound = max_compressed_block_size(size);
+    return compress_to_vector(bound, [&](uint8_t* dst, size_t capacity) {
+        return compress_adaptive_block(src, size, dst, capacity, stats);
+    });
+}
+
+static void decompress_adaptive_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                      SprayPaintStats* stats) {
+    size_t depth;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        SprayPaintAdaptiveTree tree;
+        auto reader = BitReader(payload, header.payload_size * size_t{8});
+        for (uint32_t i = 0; i < header.raw_size; ++i) {
+            if (!tree.decode(reader, dst[i])) {
+                throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+            }
+        }
+        depth = tree.depth();
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, header.payload_size * uint64_t{8});
+    record_code_length(stats, depth);
+}
+
+static void decompress_interleaved_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                         unsigned max_code_length, SprayPaintStats* stats) {
+    SprayPaintCodeLengths lengths{};
+    std::array<size_t, kInterleavedStreams> stream_size;
+    size_t data_start;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        auto lengths_size = read_code_lengths(payload, header.payload_size, lengths);
+        if (longest_code(lengths) > max_code_length) {
+            throw std::runtime_error("Block uses a longer code than the file header allows.");
+        }
+
+        data_start = lengths_size + kJumpTableSize;
+        if (data_start > header.payload_size) {
+            throw std::runtime_error("Interleaved block is too small for its jump table.");
+        }
+        size_t left = header.payload_size - data_start;
+        for (size_t s = 0; s + 1 < kInterleavedStreams; ++s) {
+            stream_size[s] = load_le32(payload + lengths_size + 4 * s);
+            if (stream_size[s] > left) {
+                throw std::runtime_error("Interleaved block jump table is corrupt.");
+            }
+            left -= stream_size[s];
+        }
+        stream_size[kInterleavedStreams - 1] = left;
+    }
+
+    std::optional<SprayPaintDecoder> decoder;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::DecoderBuild);
+        decoder.emplace(lengths);
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        std::array<BitReader, kInterleavedStreams> readers = [&] {
+            const auto* p = payload + data_start;
+            auto next = [&](size_t s) {
+                auto reader = BitReader(p, stream_size[s] * 8);
+                p += stream_size[s];
+                return reader;
+            };
+            return std::array<BitReader, kInterleavedStreams>{next(0), next(1), next(2), next(3)};
+        }();
+
+        std::array<uint8_t*, kInterleavedStreams> out;
+        std::array<size_t, kInterleavedStreams> out_size;
+        for (size_t s = 0; s < kInterleavedStreams; ++s) {
+            out[s] = dst + stream_start(header.raw_size, s);
+            out_size[s] = stream_start(header.raw_size, s + 1) - stream_start(header.raw_size, s);
+        }
+        if (decoder->decode_streams(readers, out, out_size) != out_size) {
+            throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+        }
+        for (size_t s = 0; s < kInterleavedStreams; ++s) {
+            if (readers[s].remaining() >= 8 || readers[s].position() > stream_size[s] * 8) {
+                throw std::runtime_error("Interleaved block stream does not match its jump table.");
+            }
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, (header.payload_size - data_start) * uint64_t{8});
+    record_code_length(stats, longest_code(lengths));
+}
+
+static void decompress_context_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                     unsigned max_code_length, SprayPaintStats* stats, SprayPaintBlockScratch* scratch) {
+    std::array<uint8_t, 256> map;
+    std::array<SprayPaintCodeLengths, kMaxContextClusters> lengths;
+    size_t cluster_count;
+    size_t header_size;
+    uint8_t longest = 0;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        if (header.payload_size < 1 + kContextMapSize) {
+            throw std::runtime_error("Context block is too small for its header.");
+        }
+        cluster_count = payload[0];
+        if (cluster_count == 0 || cluster_count > kMaxContextClusters) {
+            throw std::runtime_error("Context block has an invalid number of clusters.");
+        }
+        for (size_t ctx = 0; ctx < 256; ctx += 2) {
+            map[ctx] = payload[1 + ctx / 2] >> 4;
+            map[ctx + 1] = payload[1 + ctx / 2] & 0xF;
+        }
+        if (std::any_of(map.begin(), map.end(), [&](uint8_t k) { return k >= cluster_count; })) {
+            throw std::runtime_error("Context block maps a context to a cluster it does not have.");
+        }
+
+        header_size = 1 + kContextMapSize;
+        for (size_t k = 0; k < cluster_count; ++k) {
+            header_size += read_code_lengths(payload + header_size, header.payload_size - header_size, lengths[k]);
+            longest = std::max(longest, longest_code(lengths[k]));
+        }
+        if (longest > max_code_length) {
+            throw std::runtime_error("Block uses a longer code than the file header allows.");
+        }
+    }
+
+    // Up to 16 decoders of about 19KB each, too much for a worker's stack
+    std::vector<SprayPaintDecoder> owned;
+    auto& decoders = scratch != nullptr ? scratch->decoders : owned;
+    std::array<const SprayPaintDecoder*, 256> by_context;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::DecoderBuild);
+        decoders.clear();
+        decoders.reserve(kMaxContextClusters);
+        for (size_t k = 0; k < cluster_count; ++k) {
+            decoders.emplace_back(lengths[k], false);
+        }
+        for (size_t ctx = 0; ctx < 256; ++ctx) {
+            by_context[ctx] = &decoders[map[ctx]];
+        }
+        // Each entry goes on decoding with the cluster of the byte before, so
+        // a lookup emits several bytes as in the single table blocks
+        for (auto& decoder : decoders) {
+            decoder.chain(by_context);
+        }
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        auto reader = BitReader(payload + header_size, (header.payload_size - header_size) * 8);
+        uint8_t prev = 0;
+        uint32_t i = 0;
+        while (header.raw_size - i >= kDecodeMaxSymbols && reader.remaining() >= kDecodeTableBits) {
+            auto count = by_context[prev]->decode_entry(reader, dst + i);
+            if (count == 0) {
+                throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+            }
+            i += count;
+            prev = dst[i - 1];
+        }
+        for (; i < header.raw_size; ++i) {
+            if (!by_context[prev]->decode_one(reader, dst[i])) {
+                throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+            }
+            prev = dst[i];
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, (header.payload_size - header_size) * uint64_t{8});
+    record_code_length(stats, longest);
+}
+
+static void decompress_huffman_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                     unsigned max_code_length, SprayPaintStats* stats) {
+
+    SprayPaintCodeLengths lengths{};
+    size_t lengths_size;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Header);
+        lengths_size = read_code_lengths(payload, header.payload_size, lengths);
+        if (longest_code(lengths) > max_code_length) {
+            throw std::runtime_error("Block uses a longer code than the file header allows.");
+        }
+    }
+
+    std::optional<SprayPaintDecoder> decoder;
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::DecoderBuild);
+        decoder.emplace(lengths);
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        auto reader = BitReader(payload + lengths_size, (header.payload_size - lengths_size) * 8);
+        if (decoder->decode(reader, dst, header.raw_size) != header.raw_size) {
+            throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, (header.payload_size - lengths_size) * uint64_t{8});
+    record_code_length(stats, longest_code(lengths));
+}
+
+static void decompress_run_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                 SprayPaintStats* stats) {
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        const auto* p = payload;
+        const auto* end = payload + header.payload_size;
+        size_t out = 0;
+        while (p != end) {
+            auto symbol = *p++;
+            uint64_t length = 0;
+            for (unsigned shift = 0;; shift += 7) {
+                if (p == end || shift > 28) {
+                    throw std::runtime_error("Run block has a truncated or oversized run length.");
+                }
+                length |= uint64_t{*p & 0x7Fu} << shift;
+                if ((*p++ & 0x80) == 0) {
+                    break;
+                }
+            }
+            if (length >= header.raw_size - out) {
+                throw std::runtime_error("Run block decodes to more bytes than its raw size.");
+            }
+            std::memset(dst + out, symbol, length + 1);
+            out += length + 1;
+        }
+        if (out != header.raw_size) {
+            throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::RunBlocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, header.payload_size * uint64_t{8});
+}
+
+static void decompress_stored_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                    SprayPaintStats* stats) {
+    if (header.payload_size != header.raw_size) {
+        throw std::runtime_error("Stored block size does not match its raw size.");
+    }
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        std::memcpy(dst, payload, header.raw_size);
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::StoredBlocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, header.raw_size * uint64_t{8});
+}
+
+// The dictionary's decoder was built when it was loaded, there is nothing to
+// set up per block.
+static void decompress_dictionary_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                                        const SprayPaintDictionary* dictionary, SprayPaintStats* stats) {
+    if (dictionary == nullptr) {
+        throw std::runtime_error("Block is coded with a dictionary, but none was given.");
+    }
+
+    {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Decode);
+        auto reader = BitReader(payload, header.payload_size * size_t{8});
+        if (dictionary->decoder().decode(reader, dst, header.raw_size) != header.raw_size) {
+            throw std::runtime_error("Compressed data ended before the expected number of bytes were decoded.");
+        }
+    }
+
+    record(stats, SprayPaintCounter::Blocks, 1);
+    record(stats, SprayPaintCounter::BytesIn, kBlockHeaderSize + header.payload_size);
+    record(stats, SprayPaintCounter::BytesOut, header.raw_size);
+    record(stats, SprayPaintCounter::Symbols, header.raw_size);
+    record(stats, SprayPaintCounter::Bits, header.payload_size * uint64_t{8});
+    record_code_length(stats, longest_code(dictionary->lengths()));
+}
+
+void decompress_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                      unsigned max_code_length, SprayPaintStats* stats, SprayPaintBlockScratch* scratch,
+                      const SprayPaintDictionary* dictionary) {
+    switch (header.type) {
+        case SprayPaintBlockType::Huffman:
+            decompress_huffman_block(header, payload, dst, max_code_length, stats);
+            break;
+        case SprayPaintBlockType::Adaptive:
+            decompress_adaptive_block(header, payload, dst, stats);
+            break;
+        case SprayPaintBlockType::Context:
+            decompress_context_block(header, payload, dst, max_code_length, stats, scratch);
+            break;
+        case SprayPaintBlockType::Interleaved:
+            decompress_interleaved_block(header, payload, dst, max_code_length, stats);
+            break;
+        case SprayPaintBlockType::Dictionary:
+            decompress_dictionary_block(header, payload, dst, dictionary, stats);
+            break;
+        case SprayPaintBlockType::Stored:
+            decompress_stored_block(header, payload, dst, stats);
+            break;
+        case SprayPaintBlockType::Run:
+            decompress_run_block(header, payload, dst, stats);
+            break;
+        default:
+            throw std::runtime_error("Unknown block type.");
+    }
+
+    if (block_checksum(dst, header.raw_size, stats) != header.checksum) {
+        throw std::runtime_error("Block checksum mismatch, the compressed data is corrupt.");
+    }
+}
+
+void write_block_index(std::ostream& os, uint64_t offset, const std::vector<SprayPaintIndexEntry>& entries,
+                       uint32_t checksum) {
+    uint8_t buffer[kFooterSize];
+    auto write = [&](size_t size) {
+        checksum = crc32c(buffer, size, checksum);
+        os.write(reinterpret_cast<const char*>(buffer), size);
+    };
+
+    write_block_header(buffer, {SprayPaintBlockType::End, 0, 0, 0});
+    write(kBlockHeaderSize);
+
+    uint64_t raw_size = 0;
+    for (const auto& entry : entries) {
+        write_index_entry(buffer, entry);
+        write(kIndexEntrySize);
+        raw_size += entry.raw_size;
+    }
+
+    write_footer(buffer, offset + kBlockHeaderSize, entries.size(), raw_size, checksum);
+    os.write(reinterpret_cast<const char*>(buffer), kFooterSize);
+}
+
+void write_index_entry(uint8_t* dst, const SprayPaintIndexEntry& entry) {
+    store_le64(dst, entry.offset);
+    store_le64(dst + 8, entry.raw_offset);
+    store_le32(dst + 16, entry.raw_size);
+    store_le32(dst + 20, entry.stored_size);
+}
+
+void write_footer(uint8_t* dst, uint64_t index_offset, uint64_t block_count, uint64_t raw_size, uint32_t checksum) {
+    store_le64(dst, index_offset);
+    store_le64(dst + 8, block_count);
+    store_le64(dst + 16, raw_size);
+    store_le32(dst + kFooterChecksumOffset, crc32c(dst, kFooterChecksumOffset, checksum));
+    std::memcpy(dst + kFooterChecksumOffset + 4, kSprayPaintFooterMagic, sizeof(kSprayPaintFooterMagic));
+}
+
+SprayPaintFooter read_footer(const uint8_t* src) {
+    if (std::memcmp(src + kFooterChecksumOffset + 4, kSprayPaintFooterMagic, sizeof(kSprayPaintFooterMagic)) != 0) {
+        throw std::runtime_error("Compressed file is missing its block index footer.");
+    }
+    return {load_le64(src), load_le64(src + 8), load_le64(src + 16), load_le32(src + kFooterChecksumOffset)};
+}
+
+void verify_file_checksum(const uint8_t* data, size_t size, SprayPaintStats* stats) {
+    if (size < kFooterSize) {
+        throw std::runtime_error("Compressed file is too small to hold a block index.");
+    }
+    auto footer = read_footer(data + size - kFooterSize);
+    SprayPaintTimer timer(stats, SprayPaintPhase::Checksum);
+    if (crc32c(data, size - kFooterSize + kFooterChecksumOffset) != footer.checksum) {
+        throw std::runtime_error("File checksum mismatch, the compressed file is corrupt.");
+    }
+}
+
+std::vector<SprayPaintIndexEntry> read_block_index(const uint8_t* data, size_t size) {
+    std::vector<SprayPaintIndexEntry> entries;
+    read_block_index(data, size, entries);
+    return entries;
+}
+
+void read_block_index(const uint8_t* data, size_t size, std::vector<SprayPaintIndexEntry>& entries) {
+    auto header = read_file_header(data, size);
+    if (size < kSprayPaintFileHeaderSize + kBlockHeaderSize + kFooterSize) {
+        throw std::runtime_error("Compressed file is too small to hold a block index.");
+    }
+
+    auto f = read_footer(data + size - kFooterSize);
+    auto index_end = size - kFooterSize;
+    if (f.index_offset > index_end || f.block_count > index_end / kIndexEntrySize
+        || f.block_count * kIndexEntrySize != index_end - f.index_offset) {
+        throw std::runtime_error("Block index footer is corrupt.");
+    }
+
+    entries.resize(f.block_count);
+    uint64_t offset = kSprayPaintFileHeaderSize;
+    uint64_t raw_offset = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const auto* p = data + f.index_offset + i * kIndexEntrySize;
+        auto& entry = entries[i];
+        entry.offset = load_le64(p);
+        entry.raw_offset = load_le64(p + 8);
+        entry.raw_size = load_le32(p + 16);
+        entry.stored_size = load_le32(p + 20);
+
+        // Blocks are written back to back, both in the file and in the output
+        if (entry.offset != offset || entry.raw_offset != raw_offset
+            || entry.raw_size == 0 || entry.raw_size > header.block_size
+            || entry.stored_size < kBlockHeaderSize || entry.stored_size > f.index_offset - offset) {
+            throw std::runtime_error("Block index entry is corrupt.");
+        }
+        offset += entry.stored_size;
+        raw_offset += entry.raw_size;
+    }
+
+    if (raw_offset != f.raw_size || offset + kBlockHeaderSize != f.index_offset) {
+        throw std::runtime_error("Block index does not match the blocks in the file.");
+    }
+}
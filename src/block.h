@@ -0,0 +1,266 @@
+#pragma once
+
+#include "canonical.h"
+#include "histogram.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+/* .spz container layout (version 7):
+ *
+ *   file header    magic "SPZ", version, flags (u32), block size (u32), max code length (u8),
+ *                  dictionary id (u32, 0 for none)
+ *   blocks         block header (type, raw size, payload size, checksum) + payload, repeated
+ *   end block      block header with type End and zero sizes
+ *   index          one entry per block: file offset, raw offset, raw size, stored size
+ *   footer         index offset, block count, total raw size, file checksum, magic "SPZI"
+ *
+ * Checksums are CRC32C. A block's covers the bytes it decodes to, so a decoded
+ * block is checked end to end. The file's covers every byte of the file up to
+ * the checksum itself, so it is built as the file streams out and checked as
+ * it streams back in.
+ *
+ * Every block is coded independently with its own code lengths (or its own
+ * adaptive model) and starts on a byte boundary, so blocks can be compressed
+ * and decompressed in any order and the index tells a reader exactly where each
+ * block's input and output live.
+ * All integers are little endian.*/
+constexpr char kSprayPaintMagic[3] = {'S', 'P', 'Z'};
+
+constexpr uint8_t kSprayPaintVersion = 7;
+
+constexpr size_t kSprayPaintFileHeaderSize = sizeof(kSprayPaintMagic) + 1 + 4 + 4 + 1 + 4;
+
+// Input bytes per independently coded block.
+constexpr size_t kDefaultBlockSize = 1 << 20;
+
+// Raw and payload sizes are stored as u32, keep blocks well below that.
+constexpr size_t kMaxBlockSize = 1 << 30;
+
+// Longest code the compressor emits unless told otherwise. Deeper trees are
+// flattened with package-merge, which costs well under 1% on typical input.
+constexpr unsigned kDefaultMaxCodeLength = 15;
+
+enum class SprayPaintBlockType : uint8_t {
+    End = 0,
+    Huffman = 1,
+    // One pass adaptive huffman, see adaptive.h. The payload is the bitstream
+    // alone, there are no code lengths.
+    Adaptive = 2,
+    // Order-1: a few code tables, picked by the previous byte's cluster.
+    Context = 3,
+    // One code, the data split into kInterleavedStreams separately decodable bitstreams.
+    Interleaved = 4,
+    // Coded with the file's dictionary, see dictionary.h. The payload is the
+    // bitstream alone, there are no code lengths.
+    Dictionary = 5,
+    // The raw bytes as they are, for blocks coding would not shrink.
+    Stored = 6,
+    // Runs of repeated bytes, each a byte and a varint length. Used whenever
+    // that beats the one bit per byte any code costs.
+    Run = 7,
+};
+
+// How blocks are coded, chosen per file.
+enum class SprayPaintCodec : uint8_t {
+    // Two passes over each block: histogram, then canonical codes.
+    Static,
+    // One pass, codes adapt as the block is read. No header and no histogram
+    // pass, but roughly an order of magnitude slower to encode and decode.
+    Adaptive,
+    // Two passes with order-1 contexts clustered into up to kMaxContextClusters
+    // tables. Better ratio on structured text, falls back to Static per block
+    // when it does not pay off.
+    Context,
+    // Static codes with each block's data split into kInterleavedStreams
+    // bitstreams the decoder steps through side by side. Same ratio as Static
+    // plus a few bytes per block, faster to decode on a single core.
+    Interleaved,
+    // Static codes shared through a dictionary trained ahead of time, so blocks
+    // carry no code lengths. For small inputs, falls back to Static per block
+    // when a block's own codes come out smaller.
+    Dictionary,
+};
+
+// Reusable working memory for the block coders, see scratch.h.
+struct SprayPaintBlockScratch;
+
+class SprayPaintDictionary;
+
+// Bitstreams per Interleaved block.
+constexpr size_t kInterleavedStreams = 4;
+
+struct SprayPaintFileHeader {
+    uint32_t flags;
+
+    uint32_t block_size;
+
+    // No block in the file uses a longer code, so a decoder can size its
+    // tables for it up front.
+    uint8_t max_code_length;
+
+    // Id of the dictionary Dictionary blocks are coded with, 0 if there is none.
+    uint32_t dictionary;
+};
+
+struct SprayPaintBlockHeader {
+    SprayPaintBlockType type;
+
+    // Bytes the block decodes to.
+    uint32_t raw_size;
+
+    // Bytes following the block header.
+    uint32_t payload_size;
+
+    // CRC32C of the raw_size bytes the block decodes to.
+    uint32_t checksum;
+};
+
+constexpr size_t kBlockHeaderSize = 1 + 4 + 4 + 4;
+
+struct SprayPaintIndexEntry {
+    // Offset of the block header from the start of the file.
+    uint64_t offset;
+
+    // Offset of the block's first byte in the decompressed output.
+    uint64_t raw_offset;
+
+    uint32_t raw_size;
+
+    // Block header plus payload.
+    uint32_t stored_size;
+};
+
+constexpr size_t kIndexEntrySize = 8 + 8 + 4 + 4;
+
+struct SprayPaintFooter {
+    uint64_t index_offset;
+
+    uint64_t block_count;
+
+    uint64_t raw_size;
+
+    // CRC32C of the whole file up to this field.
+    uint32_t checksum;
+};
+
+constexpr char kSprayPaintFooterMagic[4] = {'S', 'P', 'Z', 'I'};
+
+constexpr size_t kFooterSize = 8 + 8 + 8 + 4 + sizeof(kSprayPaintFooterMagic);
+
+// Bytes of the footer covered by the file checksum.
+constexpr size_t kFooterChecksumOffset = 8 + 8 + 8;
+
+void write_file_header(uint8_t* dst, const SprayPaintFileHeader& header);
+
+SprayPaintFileHeader read_file_header(const uint8_t* src, size_t size);
+
+void write_block_header(uint8_t* dst, const SprayPaintBlockHeader& header);
+
+SprayPaintBlockHeader read_block_header(const uint8_t* src);
+
+// Upper bound on the payload of a block that decodes to raw_size bytes. Every
+// compressor below writes a Stored block rather than one that would not shrink
+// its input.
+constexpr size_t max_block_payload_size(size_t raw_size) {
+    return raw_size;
+}
+
+// Bytes of jump table in front of an Interleaved block's streams.
+constexpr size_t kJumpTableSize = 4 * (kInterleavedStreams - 1);
+
+// Upper bound on a whole block (header plus payload) the compressors below
+// write for raw_size bytes, whatever the codec, so callers can size their
+// buffers up front.
+constexpr size_t max_compressed_block_size(size_t raw_size) {
+    return kBlockHeaderSize + max_block_payload_size(raw_size);
+}
+
+// Compresses `size` bytes into a self contained block at dst: block header
+// followed by its payload. Returns the bytes written; throws if they do not fit
+// in capacity. No code is longer than max_code_length bits. Phase timings and
+// counters go to stats when it is not null. This and every compressor below
+// write a Run block instead when the input is long runs of repeated bytes, and
+// a Stored block when their payload would be no smaller than the input.
+size_t compress_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                      unsigned max_code_length = kDefaultMaxCodeLength, SprayPaintStats* stats = nullptr);
+
+// Compresses `size` bytes into an Interleaved block at dst. No code is longer
+// than max_code_length bits.
+size_t compress_interleaved_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                                  unsigned max_code_length = kDefaultMaxCodeLength, SprayPaintStats* stats = nullptr);
+
+// Compresses `size` bytes into a Context block at dst, or a Huffman block if
+// that comes out smaller. No code is longer than max_code_length bits. The
+// 256KB of order-1 counts and the clustering state come from scratch when it
+// is not null, and are allocated for the call otherwise.
+size_t compress_context_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                              unsigned max_code_length = kDefaultMaxCodeLength, SprayPaintStats* stats = nullptr,
+                              SprayPaintBlockScratch* scratch = nullptr);
+
+// Compresses `size` bytes into a Dictionary block at dst, or a Huffman block
+// with codes of at most max_code_length bits if that comes out smaller or the
+// input has bytes the dictionary has no code for.
+size_t compress_dictionary_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                                 const SprayPaintDictionary& dictionary,
+                                 unsigned max_code_length = kDefaultMaxCodeLength, SprayPaintStats* stats = nullptr);
+
+// Compresses `size` bytes into an Adaptive block at dst. The model starts fresh
+// for every block so blocks still decode independently.
+size_t compress_adaptive_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                               SprayPaintStats* stats = nullptr);
+
+// Same as the above, each into a vector of exactly the block's size.
+std::vector<uint8_t> compress_block(const uint8_t* src, size_t size, unsigned max_code_length = kDefaultMaxCodeLength,
+                                    SprayPaintStats* stats = nullptr);
+
+std::vector<uint8_t> compress_interleaved_block(const uint8_t* src, size_t size,
+                                                unsigned max_code_length = kDefaultMaxCodeLength,
+                                                SprayPaintStats* stats = nullptr);
+
+std::vector<uint8_t> compress_context_block(const uint8_t* src, size_t size, unsigned max_code_length = kDefaultMaxCodeLength,
+                                            SprayPaintStats* stats = nullptr);
+
+std::vector<uint8_t> compress_adaptive_block(const uint8_t* src, size_t size, SprayPaintStats* stats = nullptr);
+
+// Decodes a block's payload into dst, which must hold header.raw_size bytes.
+// Throws if a Huffman, Interleaved or Context block uses a code longer than
+// max_code_length, or if the decoded bytes do not match the block checksum.
+// Context blocks take their decoders from scratch when it is not null, and
+// Dictionary blocks throw without the dictionary.
+void decompress_block(const SprayPaintBlockHeader& header, const uint8_t* payload, uint8_t* dst,
+                      unsigned max_code_length = kMaxCodeLength, SprayPaintStats* stats = nullptr,
+                      SprayPaintBlockScratch* scratch = nullptr, const SprayPaintDictionary* dictionary = nullptr);
+
+// Huffman code lengths for counts, flattened with package-merge if the tree
+// goes deeper than max_code_length.
+SprayPaintCodeLengths build_code_lengths(const SprayPaintHistogram& counts, unsigned max_code_length);
+
+// Writes the end block, the index and the footer. `offset` is where the end
+// block starts and `checksum` the CRC32C of everything written before it.
+void write_block_index(std::ostream& os, uint64_t offset, const std::vector<SprayPaintIndexEntry>& entries,
+                       uint32_t checksum);
+
+void write_index_entry(uint8_t* dst, const SprayPaintIndexEntry& entry);
+
+// Writes the kFooterSize byte footer. `checksum` is the CRC32C of everything
+// before the footer; the stored checksum continues it over the footer fields.
+void write_footer(uint8_t* dst, uint64_t index_offset, uint64_t block_count, uint64_t raw_size, uint32_t checksum);
+
+// Reads the footer and block index of a complete file held in memory. Throws if
+// the index does not describe a contiguous run of blocks inside the file.
+std::vector<SprayPaintIndexEntry> read_block_index(const uint8_t* data, size_t size);
+
+// Same, into `entries`, reusing its capacity.
+void read_block_index(const uint8_t* data, size_t size, std::vector<SprayPaintIndexEntry>& entries);
+
+// Parses the footer at the end of a file (the last kFooterSize bytes of src).
+// Throws if the magic is missing.
+SprayPaintFooter read_footer(const uint8_t* src);
+
+// Throws if the checksum in the footer does not match the file held in memory.
+// Computing it reads the whole file once, so range reads skip it.
+void verify_file_checksum(const uint8_t* data, size_t size, SprayPaintStats* stats = nullptr);
@@ -0,0 +1,395 @@
+#include "buffer.h"
+#include "bitstream.h"
+#include "checksum.h"
+#include "dictionary.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+static const uint8_t* bytes(std::span<const std::byte> s) {
+    return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+static uint8_t* bytes(std::span<std::byte> s) {
+    return reinterpret_cast<uint8_t*>(s.data());
+}
+
+// Blocks run on the caller's thread when there is nothing to run them
+// alongside: a single thread (asked for, or all the machine has) or block.
+static bool single_threaded(const SprayPaintOptions& options, uint64_t blocks) {
+    auto threads = options.threads == 0 ? std::thread::hardware_concurrency() : options.threads;
+    return threads <= 1 || blocks <= 1;
+}
+
+// The pool to spread `blocks` blocks over, started the first time one is
+// needed, or nullptr when they should run on the caller's thread.
+static ThreadPool* block_pool(std::unique_ptr<ThreadPool>& pool, const SprayPaintOptions& options, uint64_t blocks) {
+    if (single_threaded(options, blocks)) {
+        return nullptr;
+    }
+    if (!pool) {
+        pool = std::make_unique<ThreadPool>(options.threads);
+    }
+    return pool.get();
+}
+
+/* Runs block jobs on `pool`, or straight away on the caller's thread when
+ * there is no pool. That path starts no threads and allocates nothing. Jobs
+ * get the scratch to code with: the caller's on the caller's thread, nullptr
+ * on a worker, where the block coders allocate their own. wait() rethrows the
+ * first job that failed. The pool outlives the runner, so a runner unwinding
+ * past an exception still waits for its jobs, they point into the caller's
+ * buffers.*/
+class BlockRunner {
+public:
+    BlockRunner(ThreadPool* pool, SprayPaintBlockScratch& scratch, size_t jobs) : pool_(pool), scratch_(scratch) {
+        if (this->pool_ != nullptr) {
+            this->futures_.reserve(jobs);
+        }
+    }
+
+    BlockRunner(const BlockRunner&) = delete;
+    BlockRunner& operator=(const BlockRunner&) = delete;
+
+    ~BlockRunner() {
+        for (auto& future : this->futures_) {
+            if (future.valid()) {
+                future.wait();
+            }
+        }
+    }
+
+    template <typename F>
+    void run(F&& job) {
+        if (this->pool_ != nullptr) {
+            this->futures_.push_back(this->pool_->submit([job = std::forward<F>(job)] {
+                job(nullptr);
+            }));
+        } else {
+            job(&this->scratch_);
+        }
+    }
+
+    // Waits for the job'th job, a no-op if it ran on the caller's thread.
+    void wait(size_t job) {
+        if (job < this->futures_.size()) {
+            this->futures_[job].get();
+        }
+    }
+
+    void wait() {
+        for (size_t job = 0; job < this->futures_.size(); ++job) {
+            this->wait(job);
+        }
+    }
+private:
+    ThreadPool* pool_;
+
+    SprayPaintBlockScratch& scratch_;
+
+    std::vector<std::future<void>> futures_;
+};
+
+// A `size` byte buffer to decode a block into, the scratch's if there is one.
+static uint8_t* block_buffer(SprayPaintBlockScratch* scratch, std::vector<uint8_t>& owned, size_t size) {
+    auto& buffer = scratch != nullptr ? scratch->block : owned;
+    buffer.resize(size);
+    return buffer.data();
+}
+
+size_t compress_bound(size_t size, const SprayPaintOptions& options) {
+    validate_options(options);
+    auto block_bound = [&](size_t raw_size) {
+        return kIndexEntrySize + max_compressed_block_size(raw_size);
+    };
+
+    auto bound = kSprayPaintFileHeaderSize + kBlockHeaderSize + kFooterSize;
+    bound += (size / options.block_size) * block_bound(options.block_size);
+    if (size % options.block_size != 0) {
+        bound += block_bound(size % options.block_size);
+    }
+    return bound;
+}
+
+/* Every block gets a slot in out sized for its worst case, so blocks can
+ * compress in parallel without knowing how large the ones before them come
+ * out. Finished blocks then slide down, in order, to close the gaps; a block
+ * never ends past the start of the next slot, so it can move while later
+ * blocks are still being written. On a single thread there is nothing to wait
+ * for and each block compresses straight into its final place.*/
+size_t compress(std::span<const std::byte> in, std::span<std::byte> out, const SprayPaintOptions& options) {
+    return SprayPaintCompressor(options).compress(in, out);
+}
+
+SprayPaintCompressor::SprayPaintCompressor(const SprayPaintOptions& options) : options_(options) {
+    validate_options(this->options_);
+}
+
+size_t SprayPaintCompressor::compress_bound(size_t size) const {
+    return ::compress_bound(size, this->options_);
+}
+
+size_t SprayPaintCompressor::compress(std::span<const std::byte> in, std::span<std::byte> out) {
+    const auto& options = this->options_;
+    if (out.size() < this->compress_bound(in.size())) {
+        throw std::runtime_error("Output buffer is smaller than compress_bound().");
+    }
+    const auto* src = bytes(in);
+    auto* dst = bytes(out);
+    auto* stats = options.stats;
+
+    write_file_header(dst, file_header(options));
+    uint64_t offset = kSprayPaintFileHeaderSize;
+    uint32_t checksum = crc32c(dst, offset);
+
+    auto block_count = (in.size() + options.block_size - 1) / options.block_size;
+    auto slot_size = max_compressed_block_size(options.block_size);
+    auto compress_one = [&options, src, dst, size = in.size()](size_t block, uint64_t at,
+                                                               SprayPaintBlockScratch* scratch) {
+        auto pos = block * options.block_size;
+        auto raw_size = std::min(options.block_size, size - pos);
+        auto capacity = max_compressed_block_size(raw_size);
+        return compress_block(options, src + pos, raw_size, dst + at, capacity, scratch);
+    };
+    auto append = [&](uint64_t at, size_t stored) {
+        if (at != offset) {
+            std::memmove(dst + offset, dst + at, stored);
+        }
+        SprayPaintTimer timer(stats, SprayPaintPhase::Checksum);
+        checksum = crc32c(dst + offset, stored, checksum);
+        offset += stored;
+    };
+
+    auto* pool = block_pool(this->pool_, options, block_count);
+    if (pool == nullptr) {
+        for (size_t block = 0; block < block_count; ++block) {
+            append(offset, compress_one(block, offset, &this->scratch_));
+        }
+    } else {
+        auto slot = [&](size_t block) {
+            return kSprayPaintFileHeaderSize + block * slot_size;
+        };
+        std::vector<size_t> sizes(block_count);
+        auto runner = BlockRunner(pool, this->scratch_, block_count);
+        for (size_t block = 0; block < block_count; ++block) {
+            runner.run([&compress_one, &sizes, block, at = slot(block)](SprayPaintBlockScratch* scratch) {
+                sizes[block] = compress_one(block, at, scratch);
+            });
+        }
+        for (size_t block = 0; block < block_count; ++block) {
+            runner.wait(block);
+            append(slot(block), sizes[block]);
+        }
+    }
+
+    // Block offsets are final now, the index is read back off their headers
+    auto end_block = offset;
+    write_block_header(dst + offset, {SprayPaintBlockType::End, 0, 0, 0});
+    offset += kBlockHeaderSize;
+    uint64_t at = kSprayPaintFileHeaderSize;
+    uint64_t raw_offset = 0;
+    for (size_t block = 0; block < block_count; ++block) {
+        auto header = read_block_header(dst + at);
+        auto stored_size = static_cast<uint32_t>(kBlockHeaderSize + header.payload_size);
+        write_index_entry(dst + offset, {at, raw_offset, header.raw_size, stored_size});
+        offset += kIndexEntrySize;
+        at += stored_size;
+        raw_offset += header.raw_size;
+    }
+    checksum = crc32c(dst + end_block, offset - end_block, checksum);
+    write_footer(dst + offset, end_block + kBlockHeaderSize, block_count, in.size(), checksum);
+    return offset + kFooterSize;
+}
+
+// Footer of a compressed file, checked against the file header and size.
+static SprayPaintFooter checked_footer(const uint8_t* data, size_t size, const SprayPaintFileHeader& header) {
+    if (size < kSprayPaintFileHeaderSize + kBlockHeaderSize + kFooterSize) {
+        throw std::runtime_error("Compressed file is too small to hold a block index.");
+    }
+    auto footer = read_footer(data + size - kFooterSize);
+    if (footer.index_offset < kSprayPaintFileHeaderSize + kBlockHeaderSize || footer.index_offset > size - kFooterSize
+        || footer.block_count > size / kIndexEntrySize || footer.raw_size > footer.block_count * header.block_size) {
+        throw std::runtime_error("Block index footer is corrupt.");
+    }
+    return footer;
+}
+
+uint64_t decompressed_size(std::span<const std::byte> in) {
+    auto header = read_file_header(bytes(in), in.size());
+    return checked_footer(bytes(in), in.size(), header).raw_size;
+}
+
+/* Calls f(header, payload, raw_offset) for every block, front to back. The
+ * walk follows the block headers instead of the index so it needs no memory
+ * of its own. Each header is checked against the space left in the file and
+ * the footer before f sees it, so a corrupt size can never send a payload or
+ * its output out of bounds, and the walk as a whole is checked against the
+ * footer at the end.*/
+template <typename F>
+static void for_each_block(const uint8_t* data, size_t size, F&& f) {
+    auto file_header = read_file_header(data, size);
+    auto footer = checked_footer(data, size, file_header);
+    auto end_block = footer.index_offset - kBlockHeaderSize;
+
+    uint64_t offset = kSprayPaintFileHeaderSize;
+    uint64_t raw_offset = 0;
+    uint64_t block_count = 0;
+    while (offset < end_block) {
+        auto header = read_block_header(data + offset);
+        if (header.type == SprayPaintBlockType::End || header.raw_size == 0 || header.raw_size > file_header.block_size
+            || header.raw_size > footer.raw_size - raw_offset
+            || header.payload_size > end_block - offset - kBlockHeaderSize) {
+            throw std::runtime_error("Block header is corrupt.");
+        }
+        f(header, data + offset + kBlockHeaderSize, raw_offset);
+        offset += kBlockHeaderSize + header.payload_size;
+        raw_offset += header.raw_size;
+        ++block_count;
+    }
+
+    if (offset != end_block || read_block_header(data + end_block).type != SprayPaintBlockType::End
+        || block_count != footer.block_count || raw_offset != footer.raw_size) {
+        throw std::runtime_error("Block index does not match the blocks in the file.");
+    }
+}
+
+size_t decompress(std::span<const std::byte> in, std::span<std::byte> out, const SprayPaintOptions& options) {
+    return SprayPaintDecompressor(options).decompress(in, out);
+}
+
+void decompress_range(std::span<const std::byte> in, uint64_t offset, std::span<std::byte> out,
+                      const SprayPaintOptions& options) {
+    SprayPaintDecompressor(options).decompress_range(in, offset, out);
+}
+
+void verify_compressed(std::span<const std::byte> in, const SprayPaintOptions& options) {
+    SprayPaintDecompressor(options).verify(in);
+}
+
+SprayPaintDecompressor::SprayPaintDecompressor(const SprayPaintOptions& options) : options_(options) {}
+
+size_t SprayPaintDecompressor::decompress(std::span<const std::byte> in, std::span<std::byte> out) {
+    const auto* data = bytes(in);
+    auto file_header = read_file_header(data, in.size());
+    auto footer = checked_footer(data, in.size(), file_header);
+    if (out.size() < footer.raw_size) {
+        throw std::runtime_error("Output buffer is smaller than the decompressed data.");
+    }
+
+    auto* dst = bytes(out);
+    auto* stats = this->options_.stats;
+    auto* dictionary = file_dictionary(file_header, this->options_.dictionary);
+    auto runner = BlockRunner(block_pool(this->pool_, this->options_, footer.block_count), this->scratch_,
+                              footer.block_count);
+    for_each_block(data, in.size(), [&](const SprayPaintBlockHeader& header, const uint8_t* payload, uint64_t raw_offset) {
+        runner.run([header, payload, dst = dst + raw_offset, max_code_length = file_header.max_code_length, stats,
+                    dictionary](SprayPaintBlockScratch* scratch) {
+            decompress_block(header, payload, dst, max_code_length, stats, scratch, dictionary);
+        });
+    });
+
+    // Runs here while the workers decode
+    verify_file_checksum(data, in.size(), stats);
+    runner.wait();
+    return footer.raw_size;
+}
+
+// Block header of an index entry, checked against the entry.
+static SprayPaintBlockHeader read_indexed_block_header(const uint8_t* data, const SprayPaintIndexEntry& entry) {
+    auto header = read_block_header(data + entry.offset);
+    if (header.raw_size != entry.raw_size || kBlockHeaderSize + header.payload_size != entry.stored_size) {
+        throw std::runtime_error("Block header does not match the block index.");
+    }
+    return header;
+}
+
+/* Only the blocks overlapping [offset, offset + length) are decoded, found
+ * with a binary search of the index, so the work depends on the size of the
+ * slice rather than the size of the file. Blocks entirely inside the slice
+ * decode straight into the output; the (at most two) blocks straddling its
+ * edges decode into a scratch buffer first.*/
+void SprayPaintDecompressor::decompress_range(std::span<const std::byte> in, uint64_t offset,
+                                              std::span<std::byte> out) {
+    const auto* data = bytes(in);
+    auto file_header = read_file_header(data, in.size());
+    auto& index = this->index_;
+    read_block_index(data, in.size(), index);
+
+    uint64_t raw_size = index.empty() ? 0 : index.back().raw_offset + index.back().raw_size;
+    if (offset > raw_size || out.size() > raw_size - offset) {
+        throw std::runtime_error("Range runs past the end of the decompressed data.");
+    }
+    uint64_t length = out.size();
+    if (length == 0) {
+        return;
+    }
+    auto end = offset + length;
+
+    // Last block starting at or before offset
+    auto first = std::upper_bound(index.begin(), index.end(), offset, [](uint64_t off, const SprayPaintIndexEntry& e) {
+        return off < e.raw_offset;
+    }) - 1;
+    auto last = std::lower_bound(first, index.end(), end, [](const SprayPaintIndexEntry& e, uint64_t off) {
+        return e.raw_offset < off;
+    });
+
+    auto* dst = bytes(out);
+    auto* stats = this->options_.stats;
+    auto* dictionary = file_dictionary(file_header, this->options_.dictionary);
+    auto blocks = static_cast<size_t>(last - first);
+    auto runner = BlockRunner(block_pool(this->pool_, this->options_, blocks), this->scratch_, blocks);
+    for (auto it = first; it != last; ++it) {
+        runner.run([data, dst, offset, end, entry = *it, max_code_length = file_header.max_code_length, stats,
+                    dictionary](SprayPaintBlockScratch* scratch) {
+            auto header = read_indexed_block_header(data, entry);
+            const auto* payload = data + entry.offset + kBlockHeaderSize;
+
+            auto block_end = entry.raw_offset + entry.raw_size;
+            if (entry.raw_offset >= offset && block_end <= end) {
+                decompress_block(header, payload, dst + (entry.raw_offset - offset), max_code_length, stats, scratch,
+                                 dictionary);
+                return;
+            }
+
+            std::vector<uint8_t> owned;
+            auto* buffer = block_buffer(scratch, owned, entry.raw_size);
+            decompress_block(header, payload, buffer, max_code_length, stats, scratch, dictionary);
+            auto from = std::max(offset, entry.raw_offset);
+            auto to = std::min(end, block_end);
+            std::memcpy(dst + (from - offset), buffer + (from - entry.raw_offset), to - from);
+        });
+    }
+
+    // The file checksum covers every byte of the file, only worth it when all
+    // of them are being decoded anyway
+    if (offset == 0 && length == raw_size) {
+        verify_file_checksum(data, in.size(), stats);
+    }
+    runner.wait();
+}
+
+void SprayPaintDecompressor::verify(std::span<const std::byte> in) {
+    const auto* data = bytes(in);
+    auto file_header = read_file_header(data, in.size());
+    auto footer = checked_footer(data, in.size(), file_header);
+
+    auto* stats = this->options_.stats;
+    auto* dictionary = file_dictionary(file_header, this->options_.dictionary);
+    auto runner = BlockRunner(block_pool(this->pool_, this->options_, footer.block_count), this->scratch_,
+                              footer.block_count);
+    for_each_block(data, in.size(), [&](const SprayPaintBlockHeader& header, const uint8_t* payload, uint64_t) {
+        runner.run([header, payload, max_code_length = file_header.max_code_length, stats,
+                    dictionary](SprayPaintBlockScratch* scratch) {
+            std::vector<uint8_t> owned;
+            auto* buffer = block_buffer(scratch, owned, header.raw_size);
+            decompress_block(header, payload, buffer, max_code_length, stats, scratch, dictionary);
+        });
+    });
+
+    verify_file_checksum(data, in.size(), stats);
+    runner.wait();
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "huffman.h"
+#include "scratch.h"
+#include "thread_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+/* In memory compression. compress() turns a buffer into a complete .spz file
+ * in another buffer, byte for byte what SprayPaintFile and SprayPaintStream
+ * write, and the decompress functions read one back. None of them touch the
+ * file system.
+ *
+ * With options.threads == 1 (or input that fits in a single block) nothing
+ * runs on other threads. Otherwise blocks are spread over a thread pool like
+ * the file API does.
+ *
+ * The free functions set up and tear down their scratch memory (and thread
+ * pool, if any) on every call. For many small messages use a
+ * SprayPaintCompressor / SprayPaintDecompressor instead: once it has seen a
+ * message of each codec and size, single threaded calls on it do not touch
+ * the heap at all.*/
+
+// Largest .spz file compress() can produce for `size` input bytes with these
+// options. Throws if the options are out of range.
+size_t compress_bound(size_t size, const SprayPaintOptions& options = {});
+
+// Compresses `in` into `out` and returns the size of the compressed file.
+// Throws if out is smaller than compress_bound(in.size(), options).
+size_t compress(std::span<const std::byte> in, std::span<std::byte> out, const SprayPaintOptions& options = {});
+
+// Size of the data a compressed file decompresses to, from its footer.
+uint64_t decompressed_size(std::span<const std::byte> in);
+
+// Decompresses a whole file into `out`, checking every block and the file
+// checksum, and returns decompressed_size(in). Throws if out is smaller.
+size_t decompress(std::span<const std::byte> in, std::span<std::byte> out, const SprayPaintOptions& options = {});
+
+// Decompresses out.size() bytes starting at `offset` of the original data,
+// decoding only the blocks that overlap them. Throws if the range runs past
+// the end of the data.
+void decompress_range(std::span<const std::byte> in, uint64_t offset, std::span<std::byte> out,
+                      const SprayPaintOptions& options = {});
+
+// Checks the file checksum and decodes every block to check its checksum,
+// without writing any output. Throws on the first mismatch.
+void verify_compressed(std::span<const std::byte> in, const SprayPaintOptions& options = {});
+
+/* A reusable compression context: the options, the scratch memory the block
+ * coders need, and a thread pool started on the first call that has blocks to
+ * spread over it. Output is identical to compress() with the same options.
+ * Not thread safe, use one context per thread.*/
+class SprayPaintCompressor {
+public:
+    // Throws if the options are out of range.
+    explicit SprayPaintCompressor(const SprayPaintOptions& options = {});
+
+    [[nodiscard]] size_t compress_bound(size_t size) const;
+
+    // See compress() above.
+    size_t compress(std::span<const std::byte> in, std::span<std::byte> out);
+
+    [[nodiscard]] const SprayPaintOptions& options() const {
+        return this->options_;
+    }
+private:
+    SprayPaintOptions options_;
+
+    std::unique_ptr<ThreadPool> pool_;
+
+    SprayPaintBlockScratch scratch_;
+};
+
+/* The decompression side of SprayPaintCompressor. Only options.threads,
+ * options.stats and options.dictionary are used, everything else comes from
+ * the compressed data.*/
+class SprayPaintDecompressor {
+public:
+    explicit SprayPaintDecompressor(const SprayPaintOptions& options = {});
+
+    // See decompress(), decompress_range() and verify_compressed() above.
+    size_t decompress(std::span<const std::byte> in, std::span<std::byte> out);
+
+    void decompress_range(std::span<const std::byte> in, uint64_t offset, std::span<std::byte> out);
+
+    void verify(std::span<const std::byte> in);
+private:
+    SprayPaintOptions options_;
+
+    std::unique_ptr<ThreadPool> pool_;
+
+    SprayPaintBlockScratch scratch_;
+
+    std::vector<SprayPaintIndexEntry> index_;
+};
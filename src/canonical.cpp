@@ -0,0 +1,140 @@
+#include "canonical.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+SprayPaintCodeTable canonical_codes(const SprayPaintCodeLengths& lengths) {
+    std::array<uint32_t, kMaxCodeLength + 1> length_count{};
+    for (auto len : lengths) {
+        ++length_count[len];
+    }
+    length_count[0] = 0;
+
+    // First code of each length, see RFC 1951 section 3.2.2
+    std::array<uint64_t, kMaxCodeLength + 1> next_code{};
+    uint64_t code = 0;
+    for (int len = 1; len <= kMaxCodeLength; ++len) {
+        code = (code + length_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    SprayPaintCodeTable codes{};
+    for (int sym = 0; sym < 256; ++sym) {
+        auto len = lengths[sym];
+        codes[sym].length = len;
+        if (len != 0) {
+            codes[sym].bits = next_code[len]++;
+        }
+    }
+    return codes;
+}
+
+void validate_code_lengths(const SprayPaintCodeLengths& lengths) {
+    // Kraft sum in units of 2^-63. A prefix code can use at most the whole unit.
+    uint64_t kraft = 0;
+    bool any = false;
+    for (auto len : lengths) {
+        if (len == 0) {
+            continue;
+        }
+        if (len > kMaxCodeLength) {
+            throw std::runtime_error("Code length is longer than the encoder supports.");
+        }
+        any = true;
+        kraft += uint64_t{1} << (kMaxCodeLength - len);
+        if (kraft > (uint64_t{1} << kMaxCodeLength)) {
+            throw std::runtime_error("Code lengths do not describe a valid prefix code.");
+        }
+    }
+
+    if (!any) {
+        throw std::runtime_error("Code lengths do not contain any symbols.");
+    }
+}
+
+// Nibbles needed for one code length in the header.
+static size_t length_nibbles(uint8_t len) {
+    return 1 + len / kNibbleEscape;
+}
+
+size_t write_code_lengths(uint8_t* dst, const SprayPaintCodeLengths& lengths) {
+    size_t nibble = 0;
+    auto put_nibble = [&](uint8_t value) {
+        if ((nibble & 1) == 0) {
+            dst[nibble / 2] = value << 4;
+        } else {
+            dst[nibble / 2] |= value;
+        }
+        ++nibble;
+    };
+
+    for (auto len : lengths) {
+        for (; len >= kNibbleEscape; len -= kNibbleEscape) {
+            put_nibble(kNibbleEscape);
+        }
+        put_nibble(len);
+    }
+    return (nibble + 1) / 2;
+}
+
+void write_code_lengths(std::ostream& os, const SprayPaintCodeLengths& lengths) {
+    std::array<uint8_t, kMaxCodeLengthsSize> packed{};
+    auto n = write_code_lengths(packed.data(), lengths);
+    os.write(reinterpret_cast<const char*>(packed.data()), n);
+}
+
+/* Parses the nibble header pulling bytes from next_byte(), which returns -1
+ * once the input is exhausted.*/
+template <typename NextByte>
+static SprayPaintCodeLengths parse_code_lengths(NextByte&& next_byte) {
+    SprayPaintCodeLengths lengths{};
+    int byte = 0;
+    size_t nibble = 0;
+    auto next_nibble = [&]() -> uint8_t {
+        if ((nibble & 1) == 0) {
+            byte = next_byte();
+            if (byte < 0) {
+                throw std::runtime_error("Unexpected end of data while reading code lengths.");
+            }
+        }
+        return ((nibble++ & 1) ? byte : byte >> 4) & 0x0F;
+    };
+
+    for (auto& len : lengths) {
+        unsigned total = 0;
+        uint8_t n;
+        while ((n = next_nibble()) == kNibbleEscape) {
+            total += kNibbleEscape;
+            if (total > kMaxCodeLength) {
+                throw std::runtime_error("Code length header is corrupt.");
+            }
+        }
+        len = total + n;
+    }
+
+    validate_code_lengths(lengths);
+    return lengths;
+}
+
+SprayPaintCodeLengths read_code_lengths(std::istream& is) {
+    return parse_code_lengths([&is]() -> int {
+        auto c = is.get();
+        return c == std::char_traits<char>::eof() ? -1 : c;
+    });
+}
+
+size_t read_code_lengths(const uint8_t* src, size_t size, SprayPaintCodeLengths& lengths) {
+    size_t pos = 0;
+    lengths = parse_code_lengths([&]() -> int {
+        return pos < size ? src[pos++] : -1;
+    });
+    return pos;
+}
+
+size_t code_lengths_size(const SprayPaintCodeLengths& lengths) {
+    size_t nibbles = 0;
+    for (auto len : lengths) {
+        nibbles += length_nibbles(len);
+    }
+    return (nibbles + 1) / 2;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+
+// Code length per byte value. 0 means the byte does not occur.
+using SprayPaintCodeLengths = std::array<uint8_t, 256>;
+
+// Codes are held in a uint64_t, keep one bit of headroom for the Kraft sum.
+constexpr uint8_t kMaxCodeLength = 63;
+
+// Nibble value that marks "add 15 and keep reading" in the code length header.
+constexpr uint8_t kNibbleEscape = 15;
+
+// Largest possible code length header, every symbol at kMaxCodeLength.
+constexpr size_t kMaxCodeLengthsSize = (256 * (1 + kMaxCodeLength / kNibbleEscape) + 1) / 2;
+
+struct SprayPaintCode {
+    // Code bits, right aligned. The first bit written is bit (length - 1).
+    uint64_t bits;
+
+    // 0 when the byte does not occur.
+    uint8_t length;
+};
+
+// Encoder table indexed by byte value. 4KB, so it stays in L1 while encoding.
+using SprayPaintCodeTable = std::array<SprayPaintCode, 256>;
+
+/* Canonical huffman codes are fully described by their lengths. Symbols are
+ * sorted by (length, value) and handed consecutive codes, shifting left every
+ * time the length grows. Both the encoder and decoder run this so only the
+ * lengths ever need to hit the disk.*/
+SprayPaintCodeTable canonical_codes(const SprayPaintCodeLengths& lengths);
+
+// Throws if the lengths do not describe a usable prefix code.
+void validate_code_lengths(const SprayPaintCodeLengths& lengths);
+
+/* Code length header layout: one nibble per symbol (high nibble first), 0 for
+ * symbols that do not occur. Lengths of 15 or more are written as a run of
+ * escape nibbles (15 each) followed by the remainder, so the header is 128
+ * bytes plus half a byte per escape. The last byte is padded with a 0 nibble.*/
+void write_code_lengths(std::ostream& os, const SprayPaintCodeLengths& lengths);
+
+// Writes the header into dst, which must hold code_lengths_size() bytes. Returns
+// the number of bytes written.
+size_t write_code_lengths(uint8_t* dst, const SprayPaintCodeLengths& lengths);
+
+SprayPaintCodeLengths read_code_lengths(std::istream& is);
+
+// Parses the header from at most `size` bytes of src. Returns the number of bytes used.
+size_t read_code_lengths(const uint8_t* src, size_t size, SprayPaintCodeLengths& lengths);
+
+size_t code_lengths_size(const SprayPaintCodeLengths& lengths);
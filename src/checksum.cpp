@@ -0,0 +1,72 @@
+#include "checksum.h"
+#include "bitstream.h"
+
+#include <array>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Reflected CRC32C polynomial.
+constexpr uint32_t kCrc32cPoly = 0x82F63B78;
+
+/* tables[0] is the classic byte at a time table. tables[k][b] is the CRC of
+ * byte b followed by k zero bytes, so eight table lookups advance the CRC by
+ * eight bytes at once.*/
+static constexpr auto kCrc32cTables = [] {
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (crc & 1 ? kCrc32cPoly : 0);
+        }
+        tables[0][b] = crc;
+    }
+    for (size_t k = 1; k < tables.size(); ++k) {
+        for (uint32_t b = 0; b < 256; ++b) {
+            tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xFF];
+        }
+    }
+    return tables;
+}();
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t size) {
+    const auto& t = kCrc32cTables;
+    while (size >= 8) {
+        auto word = load_le64(data) ^ crc;
+        crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^ t[5][(word >> 16) & 0xFF] ^ t[4][(word >> 24) & 0xFF]
+              ^ t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF] ^ t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        crc64 = _mm_crc32_u64(crc64, load_le64(data));
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc) {
+#if defined(__x86_64__)
+    static const auto impl = __builtin_cpu_supports("sse4.2") ? crc32c_hw : crc32c_sw;
+#else
+    static const auto impl = crc32c_sw;
+#endif
+    return ~impl(~crc, data, size);
+}
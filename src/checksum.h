@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/* CRC32C (Castagnoli polynomial), the checksum iSCSI, ext4 and friends use.
+ * On x86-64 CPUs with SSE4.2 it runs on the crc32 instruction, 8 bytes per
+ * instruction; everywhere else it falls back to slicing-by-8 tables. The CPU
+ * is checked once, on first use.
+ *
+ * Checksums chain, so data can be fed in pieces as it streams past:
+ *   crc32c(b, nb, crc32c(a, na)) == crc32c(ab, na + nb)*/
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,223 @@
+#include "context.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <span>
+
+// What one more cluster costs on disk: a code length header of about 128 bytes.
+constexpr double kClusterCostBits = 128 * 8;
+
+// k-means style passes refining the seeded clusters.
+constexpr int kRefinePasses = 3;
+
+using SprayPaintCodeCosts = std::array<float, 256>;
+
+void context_histogram(const uint8_t* src, size_t size, SprayPaintContextCounts& counts) {
+    for (auto& row : counts) {
+        row.fill(0);
+    }
+    uint8_t prev = 0;
+    for (size_t i = 0; i < size; ++i) {
+        ++counts[prev][src[i]];
+        prev = src[i];
+    }
+}
+
+// Bits needed to code h with an ideal code built from h itself.
+template <typename T>
+static double self_bits(const std::array<T, 256>& h) {
+    double total = 0;
+    double sum = 0;
+    for (auto n : h) {
+        if (n != 0) {
+            total += static_cast<double>(n);
+            sum += static_cast<double>(n) * std::log2(static_cast<double>(n));
+        }
+    }
+    return total == 0 ? 0 : total * std::log2(total) - sum;
+}
+
+// Bits per symbol under h's distribution. Symbols h has not seen get a small
+// count instead of an infinite cost so a context can still move clusters.
+static SprayPaintCodeCosts code_costs(const SprayPaintHistogram& h) {
+    double total = 0;
+    for (auto n : h) {
+        total += static_cast<double>(n);
+    }
+    SprayPaintCodeCosts costs;
+    for (int sym = 0; sym < 256; ++sym) {
+        costs[sym] = static_cast<float>(std::log2((total + 128.0) / (static_cast<double>(h[sym]) + 0.5)));
+    }
+    return costs;
+}
+
+// Bits to code a context's counts with the given per symbol costs.
+static double cross_bits(const SprayPaintContextCount* first, const SprayPaintContextCount* last,
+                         const SprayPaintCodeCosts& costs) {
+    double bits = 0;
+    for (; first != last; ++first) {
+        bits += static_cast<double>(first->count) * costs[first->symbol];
+    }
+    return bits;
+}
+
+static void add_counts(SprayPaintHistogram& dst, const std::array<uint32_t, 256>& row) {
+    for (int sym = 0; sym < 256; ++sym) {
+        dst[sym] += row[sym];
+    }
+}
+
+SprayPaintContextClusters cluster_contexts(const SprayPaintContextCounts& counts, size_t max_clusters) {
+    SprayPaintContextClusters clusters;
+    std::vector<SprayPaintContextCount> sparse;
+    cluster_contexts(counts, clusters, sparse, max_clusters);
+    return clusters;
+}
+
+// Everything but the sparse counts and the result is bounded by 256 contexts
+// or kMaxContextClusters clusters, so it lives in fixed arrays on the stack.
+void cluster_contexts(const SprayPaintContextCounts& counts, SprayPaintContextClusters& clusters,
+                      std::vector<SprayPaintContextCount>& sparse, size_t max_clusters) {
+    max_clusters = std::clamp<size_t>(max_clusters, 1, kMaxContextClusters);
+
+    std::array<uint8_t, 256> active_contexts;
+    size_t active_count = 0;
+    std::array<double, 256> own{};
+    std::array<size_t, 257> start{};
+    sparse.clear();
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        start[ctx] = sparse.size();
+        for (int sym = 0; sym < 256; ++sym) {
+            if (counts[ctx][sym] != 0) {
+                sparse.push_back({static_cast<uint8_t>(sym), counts[ctx][sym]});
+            }
+        }
+        if (sparse.size() != start[ctx]) {
+            active_contexts[active_count++] = static_cast<uint8_t>(ctx);
+            own[ctx] = self_bits(counts[ctx]);
+        }
+    }
+    start[256] = sparse.size();
+    auto active = std::span(active_contexts.data(), active_count);
+    auto score = [&](uint8_t ctx, const SprayPaintCodeCosts& costs) {
+        return cross_bits(sparse.data() + start[ctx], sparse.data() + start[ctx + 1], costs);
+    };
+
+    clusters.map.fill(0);
+    clusters.histograms.clear();
+    if (active.empty()) {
+        clusters.histograms.emplace_back();
+        return;
+    }
+
+    // Seed with the busiest context, then keep adding the context that codes
+    // worst under every seed so far while it would pay for its own table.
+    std::array<SprayPaintCodeCosts, kMaxContextClusters> costs;
+    size_t cluster_count = 0;
+    std::array<double, 256> excess;
+    excess.fill(std::numeric_limits<double>::infinity());
+    auto seed = *std::max_element(active.begin(), active.end(), [&](uint8_t a, uint8_t b) {
+        return own[a] < own[b];
+    });
+    while (true) {
+        SprayPaintHistogram h{};
+        add_counts(h, counts[seed]);
+        costs[cluster_count++] = code_costs(h);
+        if (cluster_count == max_clusters) {
+            break;
+        }
+
+        double worst = 0;
+        for (auto ctx : active) {
+            excess[ctx] = std::min(excess[ctx], score(ctx, costs[cluster_count - 1]) - own[ctx]);
+            if (excess[ctx] > worst) {
+                worst = excess[ctx];
+                seed = ctx;
+            }
+        }
+        if (worst <= kClusterCostBits) {
+            break;
+        }
+    }
+
+    for (int pass = 0; pass < kRefinePasses; ++pass) {
+        std::array<SprayPaintHistogram, kMaxContextClusters> histograms{};
+        for (auto ctx : active) {
+            size_t best = 0;
+            double best_bits = std::numeric_limits<double>::infinity();
+            for (size_t k = 0; k < cluster_count; ++k) {
+                auto bits = score(ctx, costs[k]);
+                if (bits < best_bits) {
+                    best_bits = bits;
+                    best = k;
+                }
+            }
+            clusters.map[ctx] = static_cast<uint8_t>(best);
+            add_counts(histograms[best], counts[ctx]);
+        }
+
+        // Drop clusters nothing was assigned to and renumber the rest
+        std::array<uint8_t, kMaxContextClusters> renumber{};
+        clusters.histograms.clear();
+        for (size_t k = 0; k < cluster_count; ++k) {
+            if (std::any_of(histograms[k].begin(), histograms[k].end(), [](uint64_t n) { return n != 0; })) {
+                renumber[k] = static_cast<uint8_t>(clusters.histograms.size());
+                clusters.histograms.push_back(histograms[k]);
+            }
+        }
+        for (auto ctx : active) {
+            clusters.map[ctx] = renumber[clusters.map[ctx]];
+        }
+
+        cluster_count = clusters.histograms.size();
+        for (size_t k = 0; k < cluster_count; ++k) {
+            costs[k] = code_costs(clusters.histograms[k]);
+        }
+    }
+
+    // Merge the cheapest pair while the merge costs less than the table it saves
+    std::array<double, kMaxContextClusters> bits;
+    for (size_t k = 0; k < clusters.histograms.size(); ++k) {
+        bits[k] = self_bits(clusters.histograms[k]);
+    }
+    while (clusters.histograms.size() > 1) {
+        size_t merge_a = 0, merge_b = 0;
+        double merged_bits = 0;
+        double best_delta = std::numeric_limits<double>::infinity();
+        for (size_t a = 0; a < clusters.histograms.size(); ++a) {
+            for (size_t b = a + 1; b < clusters.histograms.size(); ++b) {
+                SprayPaintHistogram h = clusters.histograms[a];
+                for (int sym = 0; sym < 256; ++sym) {
+                    h[sym] += clusters.histograms[b][sym];
+                }
+                auto merged = self_bits(h);
+                auto delta = merged - bits[a] - bits[b];
+                if (delta < best_delta) {
+                    best_delta = delta;
+                    merged_bits = merged;
+                    merge_a = a;
+                    merge_b = b;
+                }
+            }
+        }
+        if (best_delta >= kClusterCostBits) {
+            break;
+        }
+
+        for (int sym = 0; sym < 256; ++sym) {
+            clusters.histograms[merge_a][sym] += clusters.histograms[merge_b][sym];
+        }
+        bits[merge_a] = merged_bits;
+        std::copy(bits.begin() + merge_b + 1, bits.begin() + clusters.histograms.size(), bits.begin() + merge_b);
+        clusters.histograms.erase(clusters.histograms.begin() + static_cast<ptrdiff_t>(merge_b));
+        for (auto ctx : active) {
+            auto& k = clusters.map[ctx];
+            if (k == merge_b) {
+                k = static_cast<uint8_t>(merge_a);
+            } else if (k > merge_b) {
+                --k;
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "histogram.h"
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Most code tables a Context block may carry. Keeps a cluster id in a nibble.
+constexpr size_t kMaxContextClusters = 16;
+
+// Order-1 counts: counts[previous byte][byte]. 256KB, allocate it on the heap.
+using SprayPaintContextCounts = std::array<std::array<uint32_t, 256>, 256>;
+
+/* The 256 order-1 contexts (previous byte values) grouped into a few clusters,
+ * each coded with its own tree. Contexts that never occur map to cluster 0.*/
+struct SprayPaintContextClusters {
+    // Cluster used after each previous byte.
+    std::array<uint8_t, 256> map{};
+
+    // Summed counts of every context in the cluster.
+    std::vector<SprayPaintHistogram> histograms;
+};
+
+// Non zero count of one context. Most contexts only ever see a few dozen
+// distinct bytes, so clustering scores them sparsely.
+struct SprayPaintContextCount {
+    uint8_t symbol;
+
+    uint32_t count;
+};
+
+/* Memory compressing a Context block needs besides the block itself: the
+ * order-1 counts and the clustering state. Callers that compress many blocks
+ * keep one around so the vectors grow once and are reused after that.*/
+struct SprayPaintContextScratch {
+    SprayPaintContextCounts counts;
+
+    SprayPaintContextClusters clusters;
+
+    std::vector<SprayPaintContextCount> sparse;
+};
+
+// Counts every byte of src by the byte before it. The first byte's context is 0.
+// size must be below 2^32 so no count overflows.
+void context_histogram(const uint8_t* src, size_t size, SprayPaintContextCounts& counts);
+
+/* Groups contexts with similar statistics so a handful of trees capture most
+ * of what order-1 modelling buys, without paying for 256 code length headers.
+ * Seeds up to max_clusters clusters farthest first, refines them with a few
+ * k-means style passes (cost being the bits a context would take under each
+ * cluster's distribution) and then merges clusters while a merge saves more
+ * than the extra code length header it would need.*/
+SprayPaintContextClusters cluster_contexts(const SprayPaintContextCounts& counts,
+                                           size_t max_clusters = kMaxContextClusters);
+
+// Same, into clusters, with sparse as working memory. Neither allocates once
+// they have grown to fit.
+void cluster_contexts(const SprayPaintContextCounts& counts, SprayPaintContextClusters& clusters,
+                      std::vector<SprayPaintContextCount>& sparse, size_t max_clusters = kMaxContextClusters);
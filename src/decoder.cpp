@@ -0,0 +1,227 @@
+#include "decoder.h"
+
+#include <algorithm>
+
+SprayPaintDecoder::SprayPaintDecoder(const SprayPaintCodeLengths& lengths) : SprayPaintDecoder(lengths, false) {
+    std::array<const SprayPaintDecoder*, 256> next;
+    next.fill(this);
+    this->chain(next);
+}
+
+SprayPaintDecoder::SprayPaintDecoder(const SprayPaintCodeLengths& lengths, bool chain) {
+    validate_code_lengths(lengths);
+    auto codes = canonical_codes(lengths);
+
+    this->nodes_[0] = FlatNode{{kNoChild, kNoChild}, 0, false};
+    this->node_count_ = 1;
+    for (int sym = 0; sym < 256; ++sym) {
+        if (lengths[sym] != 0) {
+            this->insert(codes[sym].bits, codes[sym].length, static_cast<uint8_t>(sym));
+        }
+    }
+    this->build_table(lengths, codes);
+    if (chain) {
+        std::array<const SprayPaintDecoder*, 256> next;
+        next.fill(this);
+        this->chain(next);
+    }
+}
+
+void SprayPaintDecoder::insert(uint64_t code, uint8_t length, uint8_t symbol) {
+    uint16_t node = 0;
+    for (int b = length - 1; b >= 0; --b) {
+        auto& nd = this->nodes_[node];
+        if (nd.leaf) {
+            throw std::runtime_error("Code lengths do not describe a valid prefix code.");
+        }
+
+        auto bit = (code >> b) & 1;
+        if (nd.child[bit] == kNoChild) {
+            if (this->node_count_ == kMaxNodes) {
+                throw std::runtime_error("Decoder tree has more nodes than a byte alphabet allows.");
+            }
+            nd.child[bit] = this->node_count_;
+            this->nodes_[this->node_count_++] = FlatNode{{kNoChild, kNoChild}, 0, false};
+        } else if (b == 0) {
+            throw std::runtime_error("Code lengths do not describe a valid prefix code.");
+        }
+        node = nd.child[bit];
+    }
+
+    this->nodes_[node].leaf = true;
+    this->nodes_[node].symbol = symbol;
+}
+
+/* Built straight from the canonical code ranges rather than by walking the
+ * tree for every entry: a code of length l <= kDecodeTableBits covers the
+ * 2^(kDecodeTableBits - l) entries that start with it. Only entries no short
+ * code covers (prefixes of long codes, or bits no code uses) walk the tree, to
+ * find the node decoding resumes from.*/
+void SprayPaintDecoder::build_table(const SprayPaintCodeLengths& lengths, const SprayPaintCodeTable& codes) {
+    for (int sym = 0; sym < 256; ++sym) {
+        auto length = lengths[sym];
+        if (length == 0 || length > kDecodeTableBits) {
+            continue;
+        }
+        auto shift = kDecodeTableBits - length;
+        auto start = static_cast<uint32_t>(codes[sym].bits) << shift;
+        for (uint32_t idx = start; idx < start + (1u << shift); ++idx) {
+            auto& entry = this->table_[idx];
+            entry.symbols[0] = static_cast<uint8_t>(sym);
+            entry.count = 1;
+            entry.bits = length;
+            entry.first_bits = length;
+        }
+    }
+
+    for (uint32_t idx = 0; idx < this->table_.size(); ++idx) {
+        auto& entry = this->table_[idx];
+        if (entry.count != 0) {
+            continue;
+        }
+        uint16_t node = 0;
+        for (unsigned b = 0; b < kDecodeTableBits && node != kNoChild; ++b) {
+            node = this->nodes_[node].child[(idx >> (kDecodeTableBits - 1 - b)) & 1];
+        }
+        entry.bits = kDecodeTableBits;
+        entry.node = node;
+    }
+}
+
+/* The bits an entry has left after its symbols, shifted to the top of an
+ * index, look up the next symbol in the next decoder's table: the zeros
+ * shifted in only decide codes longer than the bits that are really there.
+ * Only the first symbol of other entries is read, which this never changes,
+ * so decoders that chain into each other can do so one after another.*/
+void SprayPaintDecoder::chain(const std::array<const SprayPaintDecoder*, 256>& next) {
+    constexpr uint32_t mask = (1u << kDecodeTableBits) - 1;
+
+    for (uint32_t idx = 0; idx < this->table_.size(); ++idx) {
+        auto& entry = this->table_[idx];
+        if (entry.count == 0) {
+            continue;
+        }
+        entry.count = 1;
+        entry.bits = entry.first_bits;
+        while (entry.count < kDecodeMaxSymbols) {
+            const auto& following = next[entry.symbols[entry.count - 1]]->table_[(idx << entry.bits) & mask];
+            if (following.count == 0 || entry.bits + following.first_bits > kDecodeTableBits) {
+                break;
+            }
+            entry.symbols[entry.count++] = following.symbols[0];
+            entry.bits += following.first_bits;
+        }
+    }
+}
+
+bool SprayPaintDecoder::walk(BitReader& reader, uint16_t node, uint8_t& symbol) const {
+    while (node != kNoChild && !this->nodes_[node].leaf) {
+        if (reader.remaining() == 0) {
+            return false;
+        }
+        node = this->nodes_[node].child[reader.peek(1)];
+        reader.consume(1);
+    }
+    if (node == kNoChild) {
+        return false;
+    }
+    symbol = this->nodes_[node].symbol;
+    return true;
+}
+
+size_t SprayPaintDecoder::decode(BitReader& reader, uint8_t* dst, size_t dst_len) const {
+    size_t out = 0;
+
+    // Fast path: every entry consumes at most kDecodeTableBits so it can never step
+    // past the end of the stream, and dst has room for a full entry's symbols.
+    while (dst_len - out >= kDecodeMaxSymbols && reader.remaining() >= kDecodeTableBits) {
+        const auto& entry = this->table_[reader.peek(kDecodeTableBits)];
+        if (entry.count == 0) {
+            reader.consume(kDecodeTableBits);
+            if (!this->walk(reader, entry.node, dst[out])) {
+                return out;
+            }
+            ++out;
+            continue;
+        }
+
+        std::memcpy(dst + out, entry.symbols, kDecodeMaxSymbols);
+        out += entry.count;
+        reader.consume(entry.bits);
+    }
+
+    // Tail: one symbol at a time so we never write past dst_len or decode the zero
+    // bits used to pad out the final byte.
+    while (out < dst_len && reader.remaining() > 0) {
+        const auto& entry = this->table_[reader.peek(kDecodeTableBits)];
+        if (entry.count == 0) {
+            if (reader.remaining() < kDecodeTableBits) {
+                break;
+            }
+            reader.consume(kDecodeTableBits);
+            if (!this->walk(reader, entry.node, dst[out])) {
+                break;
+            }
+            ++out;
+            continue;
+        }
+
+        if (entry.first_bits > reader.remaining()) {
+            break;
+        }
+        dst[out++] = entry.symbols[0];
+        reader.consume(entry.first_bits);
+    }
+
+    return out;
+}
+
+std::array<size_t, kDecodeStreams> SprayPaintDecoder::decode_streams(std::array<BitReader, kDecodeStreams>& readers,
+                                                                     const std::array<uint8_t*, kDecodeStreams>& dst,
+                                                                     const std::array<size_t, kDecodeStreams>& dst_len) const {
+    std::array<size_t, kDecodeStreams> out{};
+
+    // Work on copies: stores into dst are uint8_t stores the compiler must
+    // assume alias anything reachable, which would pin the cursors in memory.
+    auto r = readers;
+
+    // Every step writes at most kDecodeMaxSymbols per stream, so `steps` steps
+    // fit in every output without checking. A valid stream always has at least
+    // as many real symbols left as room, so lookups never decode padding either.
+    bool ok = true;
+    while (ok) {
+        size_t steps = SIZE_MAX;
+        for (size_t s = 0; s < kDecodeStreams; ++s) {
+            steps = std::min(steps, (dst_len[s] - out[s]) / kDecodeMaxSymbols);
+        }
+        if (steps == 0) {
+            break;
+        }
+
+        for (; steps > 0 && ok; --steps) {
+            for (size_t s = 0; s < kDecodeStreams; ++s) {
+                const auto& entry = this->table_[r[s].peek(kDecodeTableBits)];
+                if (entry.count == 0) [[unlikely]] {
+                    r[s].consume(kDecodeTableBits);
+                    ok &= this->walk(r[s], entry.node, dst[s][out[s]]);
+                    ++out[s];
+                    continue;
+                }
+                std::memcpy(dst[s] + out[s], entry.symbols, kDecodeMaxSymbols);
+                out[s] += entry.count;
+                r[s].consume(entry.bits);
+            }
+        }
+    }
+
+    readers = r;
+    if (!ok) {
+        return out;
+    }
+
+    // The last few symbols of each stream go through the checked path
+    for (size_t s = 0; s < kDecodeStreams; ++s) {
+        out[s] += this->decode(readers[s], dst[s] + out[s], dst_len[s] - out[s]);
+    }
+    return out;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "huffman.h"
+#include "bitstream.h"
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Number of bits looked at per table lookup. 2^11 entries of 8 bytes keeps the
+// whole table at 16KB so it stays hot in cache while decoding.
+constexpr unsigned kDecodeTableBits = 11;
+
+// Max number of symbols a single table entry can emit.
+constexpr unsigned kDecodeMaxSymbols = 3;
+
+// Independent bitstreams decode_streams() steps through together.
+constexpr size_t kDecodeStreams = 4;
+
+struct SprayPaintDecodeEntry {
+    // Symbols fully decoded from the kDecodeTableBits bits this entry is indexed by.
+    uint8_t symbols[kDecodeMaxSymbols];
+
+    // Number of valid symbols. 0 means the code is longer than kDecodeTableBits
+    // and decoding continues by walking the tree from `node`.
+    uint8_t count;
+
+    // Bits consumed by all `count` symbols.
+    uint8_t bits;
+
+    // Bits consumed by symbols[0] on its own.
+    uint8_t first_bits;
+
+    // Node reached after consuming kDecodeTableBits bits when count == 0.
+    uint16_t node;
+};
+
+/* SprayPaintDecoder rebuilds the canonical code tree from its code lengths as flat
+ * arrays (no pointers, no per node allocations) and builds a lookup table
+ * indexed by the next kDecodeTableBits bits of the stream. Each lookup emits every
+ * symbol that is fully contained in those bits (up to kDecodeMaxSymbols) and
+ * advances the bit cursor by the bits they used. Codes longer than the table
+ * fall back to walking the flattened tree, which is rare since long codes are
+ * by definition the least frequent ones.*/
+class SprayPaintDecoder {
+public:
+    explicit SprayPaintDecoder(const SprayPaintCodeLengths& lengths);
+
+    // With chain false every table entry holds only its first symbol until
+    // chain() is called.
+    SprayPaintDecoder(const SprayPaintCodeLengths& lengths, bool chain);
+
+    explicit SprayPaintDecoder(SprayPaintTree& tree) : SprayPaintDecoder(tree.code_lengths()) {}
+
+    // Decodes up to dst_len symbols into dst. Stops early when the reader runs out
+    // of bits and returns the number of symbols written.
+    size_t decode(BitReader& reader, uint8_t* dst, size_t dst_len) const;
+
+    /* Decodes kDecodeStreams independent bitstreams sharing this code, stream s
+     * into dst[s] for up to dst_len[s] symbols. The streams advance in lockstep,
+     * one table lookup each per step, so the CPU works on four independent
+     * chains of loads instead of waiting on each lookup's bit count before it
+     * can start the next. Returns the number of symbols written per stream.*/
+    std::array<size_t, kDecodeStreams> decode_streams(std::array<BitReader, kDecodeStreams>& readers,
+                                                      const std::array<uint8_t*, kDecodeStreams>& dst,
+                                                      const std::array<size_t, kDecodeStreams>& dst_len) const;
+
+    /* Fills table entries with up to kDecodeMaxSymbols symbols, each symbol
+     * after the first decoded with next[previous symbol]. For callers that
+     * pick the decoder for every symbol by the one before it (next holding a
+     * pointer to this decoder for every symbol is the plain case), so they
+     * still decode a whole entry per lookup with decode_entry(). Every decoder
+     * in next must outlive its use here.*/
+    void chain(const std::array<const SprayPaintDecoder*, 256>& next);
+
+    // Decodes one table lookup's worth of symbols into dst, which must have
+    // room for kDecodeMaxSymbols, and returns how many there were. The reader
+    // must have at least kDecodeTableBits bits left. Returns 0 if the bits
+    // follow a pattern no code uses.
+    size_t decode_entry(BitReader& reader, uint8_t* dst) const {
+        const auto& entry = this->table_[reader.peek(kDecodeTableBits)];
+        if (entry.count == 0) [[unlikely]] {
+            reader.consume(kDecodeTableBits);
+            return this->walk(reader, entry.node, dst[0]) ? 1 : 0;
+        }
+        std::memcpy(dst, entry.symbols, kDecodeMaxSymbols);
+        reader.consume(entry.bits);
+        return entry.count;
+    }
+
+    // Decodes a single symbol, for callers that switch decoders between
+    // symbols. Returns false when the reader runs out of bits.
+    bool decode_one(BitReader& reader, uint8_t& symbol) const {
+        const auto& entry = this->table_[reader.peek(kDecodeTableBits)];
+        if (entry.count == 0) {
+            if (reader.remaining() < kDecodeTableBits) {
+                return false;
+            }
+            reader.consume(kDecodeTableBits);
+            return this->walk(reader, entry.node, symbol);
+        }
+        if (entry.first_bits > reader.remaining()) {
+            return false;
+        }
+        symbol = entry.symbols[0];
+        reader.consume(entry.first_bits);
+        return true;
+    }
+private:
+    struct FlatNode {
+        uint16_t child[2];
+
+        uint8_t symbol;
+
+        bool leaf;
+    };
+
+    // Huffman trees over bytes have at most 256 leaves and 255 internal nodes.
+    static constexpr size_t kMaxNodes = 511;
+
+    // Marks a child slot no code leads to. Only happens for incomplete codes,
+    // e.g. the single 1 bit code of a tree with one leaf.
+    static constexpr uint16_t kNoChild = 0xFFFF;
+
+    void insert(uint64_t code, uint8_t length, uint8_t symbol);
+
+    void build_table(const SprayPaintCodeLengths& lengths, const SprayPaintCodeTable& codes);
+
+    // Walks the flattened tree from `node` one bit at a time. Returns false if
+    // the reader runs out of bits or follows a bit pattern no code uses.
+    bool walk(BitReader& reader, uint16_t node, uint8_t& symbol) const;
+
+    std::array<FlatNode, kMaxNodes> nodes_{};
+
+    uint16_t node_count_ = 0;
+
+    std::array<SprayPaintDecodeEntry, 1 << kDecodeTableBits> table_{};
+};
@@ -0,0 +1,99 @@
+#include "dictionary.h"
+#include "bitstream.h"
+#include "checksum.h"
+#include "package_merge.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+constexpr size_t kDictionaryHeaderSize = sizeof(kSprayPaintDictionaryMagic) + 1 + 4;
+
+static uint32_t dictionary_id(const SprayPaintCodeLengths& lengths) {
+    uint8_t header[kMaxCodeLengthsSize];
+    auto id = crc32c(header, write_code_lengths(header, lengths));
+    // 0 is "no dictionary" in the file header
+    return id != 0 ? id : 1;
+}
+
+SprayPaintDictionary::SprayPaintDictionary(const SprayPaintCodeLengths& lengths)
+        : lengths_(lengths), codes_(canonical_codes(lengths)),
+          decoder_(std::make_shared<const SprayPaintDecoder>(lengths)), id_(dictionary_id(lengths)) {}
+
+SprayPaintDictionary SprayPaintDictionary::train(SprayPaintHistogram counts, unsigned max_code_length) {
+    if (max_code_length < kMinCodeLengthLimit || max_code_length > kMaxCodeLength) {
+        throw std::runtime_error("Max code length must be between 8 and 63 bits.");
+    }
+
+    // Bytes the sample never had still need a code, they get the longest ones
+    for (auto& count : counts) {
+        ++count;
+    }
+    return SprayPaintDictionary(build_code_lengths(counts, max_code_length));
+}
+
+SprayPaintDictionary SprayPaintDictionary::train(std::span<const std::byte> samples, unsigned max_code_length) {
+    return train(histogram(reinterpret_cast<const uint8_t*>(samples.data()), samples.size()), max_code_length);
+}
+
+std::vector<uint8_t> SprayPaintDictionary::serialize() const {
+    std::vector<uint8_t> out(kDictionaryHeaderSize + code_lengths_size(this->lengths_));
+    std::memcpy(out.data(), kSprayPaintDictionaryMagic, sizeof(kSprayPaintDictionaryMagic));
+    out[sizeof(kSprayPaintDictionaryMagic)] = kSprayPaintDictionaryVersion;
+    store_le32(out.data() + sizeof(kSprayPaintDictionaryMagic) + 1, this->id_);
+    write_code_lengths(out.data() + kDictionaryHeaderSize, this->lengths_);
+    return out;
+}
+
+SprayPaintDictionary SprayPaintDictionary::deserialize(const uint8_t* data, size_t size) {
+    if (size < kDictionaryHeaderSize
+        || std::memcmp(data, kSprayPaintDictionaryMagic, sizeof(kSprayPaintDictionaryMagic)) != 0) {
+        throw std::runtime_error("Input is not a spray paint dictionary.");
+    }
+    if (data[sizeof(kSprayPaintDictionaryMagic)] != kSprayPaintDictionaryVersion) {
+        throw std::runtime_error("Unsupported spray paint dictionary version.");
+    }
+
+    SprayPaintCodeLengths lengths{};
+    auto lengths_size = read_code_lengths(data + kDictionaryHeaderSize, size - kDictionaryHeaderSize, lengths);
+    if (kDictionaryHeaderSize + lengths_size != size) {
+        throw std::runtime_error("Dictionary has trailing bytes.");
+    }
+    auto dictionary = SprayPaintDictionary(lengths);
+    if (dictionary.id() != load_le32(data + sizeof(kSprayPaintDictionaryMagic) + 1)) {
+        throw std::runtime_error("Dictionary id mismatch, the dictionary is corrupt.");
+    }
+    return dictionary;
+}
+
+void SprayPaintDictionary::save(const std::string& path) const {
+    auto bytes = this->serialize();
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    if (!out) {
+        throw std::runtime_error("Could not write dictionary '" + path + "'");
+    }
+}
+
+SprayPaintDictionary SprayPaintDictionary::load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Could not open dictionary '" + path + "'");
+    }
+    std::vector<uint8_t> bytes{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return deserialize(bytes.data(), bytes.size());
+}
+
+const SprayPaintDictionary* file_dictionary(const SprayPaintFileHeader& header, const SprayPaintDictionary* dictionary) {
+    if (header.dictionary == 0) {
+        return nullptr;
+    }
+    if (dictionary == nullptr) {
+        throw std::runtime_error("File was compressed with a dictionary, it is needed to decompress it.");
+    }
+    if (dictionary->id() != header.dictionary) {
+        throw std::runtime_error("File was compressed with a different dictionary.");
+    }
+    return dictionary;
+}
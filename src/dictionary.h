@@ -0,0 +1,79 @@
+#pragma once
+
+#include "decoder.h"
+#include "histogram.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+/* A dictionary is a code table both sides agree on ahead of time, trained on
+ * a sample of the data. Messages of a few hundred bytes cannot pay for their
+ * own code lengths (~130 bytes), so Dictionary blocks carry only the coded
+ * data and the file header carries the dictionary's id instead.
+ *
+ * Dictionary file layout:
+ *   magic "SPZD", version (u8), id (u32), code lengths (as in a Huffman block)
+ *
+ * The id is the CRC32C of the code lengths, so two dictionaries with the same
+ * codes have the same id and a damaged dictionary file fails to load. 0 is
+ * kept for files without a dictionary.*/
+constexpr char kSprayPaintDictionaryMagic[4] = {'S', 'P', 'Z', 'D'};
+
+constexpr uint8_t kSprayPaintDictionaryVersion = 1;
+
+class SprayPaintDictionary {
+public:
+    // Throws if the lengths are not a usable prefix code.
+    explicit SprayPaintDictionary(const SprayPaintCodeLengths& lengths);
+
+    // Codes fitted to the byte counts of a sample. Every byte value gets a
+    // code whether the sample has it or not, so any input can be coded.
+    static SprayPaintDictionary train(SprayPaintHistogram counts, unsigned max_code_length = kDefaultMaxCodeLength);
+
+    static SprayPaintDictionary train(std::span<const std::byte> samples,
+                                      unsigned max_code_length = kDefaultMaxCodeLength);
+
+    [[nodiscard]] std::vector<uint8_t> serialize() const;
+
+    // Throws if data is not a dictionary or does not match its id.
+    static SprayPaintDictionary deserialize(const uint8_t* data, size_t size);
+
+    void save(const std::string& path) const;
+
+    static SprayPaintDictionary load(const std::string& path);
+
+    [[nodiscard]] uint32_t id() const {
+        return this->id_;
+    }
+
+    [[nodiscard]] const SprayPaintCodeLengths& lengths() const {
+        return this->lengths_;
+    }
+
+    [[nodiscard]] const SprayPaintCodeTable& codes() const {
+        return this->codes_;
+    }
+
+    [[nodiscard]] const SprayPaintDecoder& decoder() const {
+        return *this->decoder_;
+    }
+private:
+    SprayPaintCodeLengths lengths_;
+
+    SprayPaintCodeTable codes_;
+
+    // Built once for every block decoded with the dictionary. Read only, so
+    // copies and worker threads share it.
+    std::shared_ptr<const SprayPaintDecoder> decoder_;
+
+    uint32_t id_;
+};
+
+// The dictionary to decode a file's blocks with: nullptr for a file written
+// without one, otherwise `dictionary`. Throws if the file needs a dictionary
+// and `dictionary` is missing or has a different id.
+const SprayPaintDictionary* file_dictionary(const SprayPaintFileHeader& header, const SprayPaintDictionary* dictionary);
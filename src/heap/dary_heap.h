@@ -0,0 +1,165 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/* DaryHeap is a d-ary heap with the arity and ordering fixed at compile time.
+ * There are no virtual calls and no optional/exception checked index math on
+ * the hot path, elements are only ever moved (so move-only types work), and
+ * a wider node (4 or 8 children) halves or thirds the tree height so sift
+ * down touches fewer cache lines than a binary heap.
+ *
+ * Compare(a, b) returns true when a should come out before b, so std::less
+ * gives a min heap and std::greater a max heap.
+ *
+ * The formulae for the relatives of node r with arity d are:
+ *   Parent(r)      = (r - 1) / d   if r != 0
+ *   First child(r) = d * r + 1     if d * r + 1 < n*/
+template <typename T, size_t Arity = 4, typename Compare = std::less<T>>
+requires (Arity >= 2) && std::strict_weak_order<Compare, const T&, const T&>
+class DaryHeap {
+public:
+    explicit DaryHeap(Compare compare = Compare()) : compare_(std::move(compare)) {}
+
+    // Builds the heap from [first, last) in O(n).
+    template <std::input_iterator It>
+    DaryHeap(It first, It last, Compare compare = Compare()) : compare_(std::move(compare)) {
+        this->heapify(first, last);
+    }
+
+    // Appends [first, last) and restores the heap property in O(n) for the
+    // whole heap, cheaper than putting the elements one at a time.
+    template <std::input_iterator It>
+    void heapify(It first, It last) {
+        if constexpr (std::forward_iterator<It>) {
+            this->heap_.reserve(this->heap_.size() + std::distance(first, last));
+        }
+        for (; first != last; ++first) {
+            this->heap_.emplace_back(*first);
+        }
+        if (this->heap_.size() < 2) {
+            return;
+        }
+        for (auto idx = parent(this->heap_.size() - 1) + 1; idx-- > 0;) {
+            this->sift_down(idx);
+        }
+    }
+
+    void put(const T& value) {
+        this->heap_.push_back(value);
+        this->sift_up(this->heap_.size() - 1);
+    }
+
+    void put(T&& value) {
+        this->heap_.push_back(std::move(value));
+        this->sift_up(this->heap_.size() - 1);
+    }
+
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        this->heap_.emplace_back(std::forward<Args>(args)...);
+        this->sift_up(this->heap_.size() - 1);
+    }
+
+    // Removes and returns the first element.
+    T pop() {
+        if (this->heap_.empty()) {
+            throw std::runtime_error("there is no root node");
+        }
+        T top = std::move(this->heap_.front());
+        if (this->heap_.size() > 1) {
+            this->heap_.front() = std::move(this->heap_.back());
+        }
+        this->heap_.pop_back();
+        if (!this->heap_.empty()) {
+            this->sift_down(0);
+        }
+        return top;
+    }
+
+    // First element without removing it. The heap must not be empty.
+    [[nodiscard]] const T& top() const {
+        return this->heap_.front();
+    }
+
+    [[nodiscard]] size_t size() const {
+        return this->heap_.size();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return this->heap_.empty();
+    }
+
+    void reserve(size_t cap) {
+        this->heap_.reserve(cap);
+    }
+
+    void clear() {
+        this->heap_.clear();
+    }
+private:
+    static constexpr size_t parent(size_t idx) {
+        return (idx - 1) / Arity;
+    }
+
+    static constexpr size_t first_child(size_t idx) {
+        return Arity * idx + 1;
+    }
+
+    // Moves the element at idx up into place, shifting parents down into the
+    // hole instead of swapping at every level.
+    void sift_up(size_t idx) {
+        T value = std::move(this->heap_[idx]);
+        while (idx > 0) {
+            auto p = parent(idx);
+            if (!this->compare_(value, this->heap_[p])) {
+                break;
+            }
+            this->heap_[idx] = std::move(this->heap_[p]);
+            idx = p;
+        }
+        this->heap_[idx] = std::move(value);
+    }
+
+    void sift_down(size_t idx) {
+        auto n = this->heap_.size();
+        T value = std::move(this->heap_[idx]);
+        while (true) {
+            auto first = first_child(idx);
+            if (first >= n) {
+                break;
+            }
+
+            // Best of up to Arity children, they sit next to each other in memory
+            auto best = first;
+            auto last = first + Arity < n ? first + Arity : n;
+            for (auto c = first + 1; c < last; ++c) {
+                if (this->compare_(this->heap_[c], this->heap_[best])) {
+                    best = c;
+                }
+            }
+
+            if (!this->compare_(this->heap_[best], value)) {
+                break;
+            }
+            this->heap_[idx] = std::move(this->heap_[best]);
+            idx = best;
+        }
+        this->heap_[idx] = std::move(value);
+    }
+
+    std::vector<T> heap_;
+
+    [[no_unique_address]] Compare compare_;
+};
+
+template <typename T, size_t Arity = 4>
+using DaryMinHeap = DaryHeap<T, Arity, std::less<T>>;
+
+template <typename T, size_t Arity = 4>
+using DaryMaxHeap = DaryHeap<T, Arity, std::greater<T>>;
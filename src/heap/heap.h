@@ -3,6 +3,8 @@
 #include <vector>
 #include <optional>
 #include <cassert>
+#include <concepts>
+#include <stdexcept>
 
 ///The formulae for calculating the array indices of the various relatives of a node are as follows.
 // The total number of nodes in the tree is n.
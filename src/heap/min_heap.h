@@ -49,8 +49,8 @@ T MinHeap<T>::root() {
 template <typename T>
 requires Comparable<T>
 MinHeap<T>::MinHeap(int cap): cap_(cap) {
-    std::vector<T> vec;
-    heap_ = std::move(vec);
+    // The heap never grows past cap, so allocate it once up front
+    heap_.reserve(cap);
 }
 
 template <typename T>
@@ -0,0 +1,48 @@
+#include "histogram.h"
+#include "bitstream.h"
+
+#include <algorithm>
+
+// Bytes counted into the 32 bit tables before they are folded into the result.
+// Each table sees at most an eighth of them, well clear of overflowing.
+constexpr size_t kHistogramFoldSize = size_t{1} << 31;
+
+// One count table per byte lane of a 64 bit word.
+constexpr int kHistogramTables = 8;
+
+static void histogram_chunk(const uint8_t* data, size_t size, SprayPaintHistogram& counts) {
+    uint32_t tables[kHistogramTables][256] = {};
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        auto a = load_le64(data + i);
+        auto b = load_le64(data + i + 8);
+        for (int lane = 0; lane < kHistogramTables; ++lane) {
+            ++tables[lane][(a >> (lane * 8)) & 0xFF];
+        }
+        for (int lane = 0; lane < kHistogramTables; ++lane) {
+            ++tables[lane][(b >> (lane * 8)) & 0xFF];
+        }
+    }
+    for (; i < size; ++i) {
+        ++tables[i % kHistogramTables][data[i]];
+    }
+
+    for (int sym = 0; sym < 256; ++sym) {
+        for (auto& table : tables) {
+            counts[sym] += table[sym];
+        }
+    }
+}
+
+SprayPaintHistogram histogram(const uint8_t* data, size_t size) {
+    SprayPaintHistogram counts{};
+    for (size_t pos = 0; pos < size; pos += kHistogramFoldSize) {
+        histogram_chunk(data + pos, std::min(kHistogramFoldSize, size - pos), counts);
+    }
+    return counts;
+}
+
+size_t distinct_symbols(const SprayPaintHistogram& counts) {
+    return std::count_if(counts.begin(), counts.end(), [](uint64_t c) { return c != 0; });
+}
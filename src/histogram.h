@@ -0,0 +1,18 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+// Number of occurrences of every byte value.
+using SprayPaintHistogram = std::array<uint64_t, 256>;
+
+/* Counts every byte in data. The input is read a 64 bit word at a time and each
+ * byte lane of the word has its own count table, so runs of the same byte don't
+ * serialize on a load/store of the same counter. The tables use 32 bit counters
+ * (8KB total, so they stay in L1) and are folded into the 64 bit result every
+ * 2^31 bytes.*/
+SprayPaintHistogram histogram(const uint8_t* data, size_t size);
+
+// Number of distinct byte values with a non zero count.
+size_t distinct_symbols(const SprayPaintHistogram& counts);
@@ -1,14 +1,23 @@
 #include "huffman.h"
-
-std::unordered_map<char, int> build_char_map(std::ifstream& is) {
+#include "buffer.h"
+#include "bitstream.h"
+#include "checksum.h"
+#include "decoder.h"
+#include "dictionary.h"
+#include "mapped_file.h"
+#include "package_merge.h"
+#include "thread_pool.h"
+#include "heap/dary_heap.h"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+static std::unordered_map<char, int> to_char_map(const SprayPaintHistogram& counts) {
     std::unordered_map<char, int> char_map;
-    char c;
-    while (is.get(static_cast<char &>(c))) {
-        auto it = char_map.find(c);
-        if (it == char_map.end()) {
-            char_map.insert(std::make_pair(c, 1));
-        } else {
-            it->second = ++it->second;
+    for (int sym = 0; sym < 256; ++sym) {
+        if (counts[sym] != 0) {
+            char_map.emplace(static_cast<char>(sym), static_cast<int>(counts[sym]));
         }
     }
 
@@ -19,274 +28,571 @@ std::unordered_map<char, int> build_char_map(std::ifstream& is) {
     return char_map;
 }
 
-void SprayPaintTree::build() {
+std::unordered_map<char, int> build_char_map(std::ifstream& is) {
+    SprayPaintHistogram counts{};
+    std::vector<char> chunk(1 << 16);
+    while (is.read(chunk.data(), chunk.size()) || is.gcount() > 0) {
+        auto part = histogram(reinterpret_cast<const uint8_t*>(chunk.data()), is.gcount());
+        for (int sym = 0; sym < 256; ++sym) {
+            counts[sym] += part[sym];
+        }
+    }
+    return to_char_map(counts);
+}
+
+std::unordered_map<char, int> build_char_map(const uint8_t* data, size_t size) {
+    return to_char_map(histogram(data, size));
+}
+
+/* Entry of the build heap: the weight of a subtree and the arena index of its
+ * root (or its symbol, before a leaf is placed in the arena). Small and
+ * trivially copyable so heap operations are just swaps.*/
+struct SprayPaintHeapEntry {
+    uint64_t weight;
+
+    uint16_t node;
+
+    bool operator<(const SprayPaintHeapEntry& cmp) const {
+        return this->weight < cmp.weight;
+    }
+};
+
+uint16_t SprayPaintTree::add_node(const SprayPaintTreeNode& node) {
+    if (this->node_count_ == kMaxNodes) {
+        throw std::runtime_error("Tree has more nodes than a byte alphabet allows.");
+    }
+    this->nodes_[this->node_count_] = node;
+    return this->node_count_++;
+}
+
+uint16_t SprayPaintTree::add_leaf(uint64_t weight, uint8_t value) {
+    SprayPaintTreeNode node;
+    node.weight_ = weight;
+    node.value_ = value;
+    node.leaf_ = true;
+    return this->add_node(node);
+}
+
+uint16_t SprayPaintTree::add_internal(uint64_t weight, uint16_t left, uint16_t right) {
+    SprayPaintTreeNode node;
+    node.weight_ = weight;
+    node.left_ = left;
+    node.right_ = right;
+    return this->add_node(node);
+}
+
+void SprayPaintTree::build(SprayPaintBuildStrategy strategy) {
     if (!this->charset_.has_value()) {
         throw std::runtime_error("charset is not registered; please use .register_charset() to register a character set for encoding.");
     }
+    if (distinct_symbols(this->charset_.value()) == 0) {
+        throw std::runtime_error("charset is empty; there is nothing to build a tree from.");
+    }
 
-    auto charset = this->charset_.value();
-    auto min_heap = MinHeap<SprayPaintTree>(charset.size());
+    this->reset();
+    switch (strategy) {
+        case SprayPaintBuildStrategy::Heap:
+            this->build_heap();
+            break;
+        case SprayPaintBuildStrategy::TwoQueue:
+            this->build_two_queue();
+            break;
+    }
+}
 
-    /* First we will build the min heap
-     * and then loop through all min_heap values
-     * adding them to the max_heap. This will
-     * ensure that not too much memory is used during compression.*/
-    for (auto i : charset) {
-        auto nt = SprayPaintTree(i.second, i.first);
-        min_heap.put(nt);
+void SprayPaintTree::build_heap() {
+    const auto& charset = this->charset_.value();
+    std::array<SprayPaintHeapEntry, 256> leaves;
+    size_t n = 0;
+    for (int sym = 0; sym < 256; ++sym) {
+        if (charset[sym] != 0) {
+            leaves[n++] = {charset[sym], this->add_leaf(charset[sym], static_cast<uint8_t>(sym))};
+        }
     }
 
-    /* For now I will assume that there are always two pop'ed variables available
-     * I will adjust if needed to account for odd numbered heaps.*/
+    auto min_heap = DaryMinHeap<SprayPaintHeapEntry>(leaves.begin(), leaves.begin() + n);
+
+    // Merge the two lightest subtrees until a single tree is left
     while (min_heap.size() > 1) {
-        auto tmp1 = min_heap.pop().root().value();
-        auto tmp2 = min_heap.pop().root().value();
-        auto tmp3 = SprayPaintTree(std::move(tmp1), std::move(tmp2));
-        min_heap.put(std::move(tmp3));
+        auto l = min_heap.pop();
+        auto r = min_heap.pop();
+        auto weight = l.weight + r.weight;
+        min_heap.put({weight, this->add_internal(weight, l.node, r.node)});
     }
-    auto tree = std::move(min_heap.pop().root_);
-    this->root_.swap(tree);
+    this->root_ = min_heap.pop().node;
 }
 
-void SprayPaintNode::serialize(std::ofstream& os) {
-    os.write(reinterpret_cast<char*>(&this->weight_), sizeof(this->weight_));
-    os.write(reinterpret_cast<char*>(&this->value_), sizeof(this->value_));
-    os.write(reinterpret_cast<char*>(&this->leaf_), sizeof(this->leaf_));
+/* Classic two queue construction (van Leeuwen). Leaves go into the arena sorted
+ * by weight, and every merged node weighs at least as much as the one merged
+ * before it, so internal nodes are appended in sorted order too. Both queues
+ * are then just cursors into the arena: the lightest subtree is always at the
+ * front of one of them.*/
+void SprayPaintTree::build_two_queue() {
+    const auto& charset = this->charset_.value();
+
+    std::array<SprayPaintHeapEntry, 256> leaves;
+    size_t n = 0;
+    for (int sym = 0; sym < 256; ++sym) {
+        if (charset[sym] != 0) {
+            leaves[n++] = {charset[sym], static_cast<uint16_t>(sym)};
+        }
+    }
+    // Ties are broken on the symbol so the tree does not depend on the sort
+    std::sort(leaves.begin(), leaves.begin() + n, [](const SprayPaintHeapEntry& a, const SprayPaintHeapEntry& b) {
+        return a.weight < b.weight || (a.weight == b.weight && a.node < b.node);
+    });
+    for (size_t i = 0; i < n; ++i) {
+        this->add_leaf(leaves[i].weight, static_cast<uint8_t>(leaves[i].node));
+    }
 
-    bool has_left = (left_ != nullptr);
-    bool has_right = (right_ != nullptr);
-    os.write(reinterpret_cast<const char*>(&has_left), sizeof(has_left));
-    os.write(reinterpret_cast<const char*>(&has_right), sizeof(has_right));
+    uint16_t next_leaf = 0;
+    auto next_internal = static_cast<uint16_t>(n);
+    auto lightest = [&]() {
+        if (next_leaf < n && (next_internal == this->node_count_ ||
+                              this->nodes_[next_leaf].weight_ <= this->nodes_[next_internal].weight_)) {
+            return next_leaf++;
+        }
+        return next_internal++;
+    };
 
-    if (has_left) left_->serialize(os);
-    if (has_right) right_->serialize(os);
+    for (size_t merges = 1; merges < n; ++merges) {
+        auto l = lightest();
+        auto r = lightest();
+        this->add_internal(this->nodes_[l].weight_ + this->nodes_[r].weight_, l, r);
+    }
+    this->root_ = static_cast<uint16_t>(this->node_count_ - 1);
 }
 
-void SprayPaintTree::serialize(std::ofstream& os) {
-    this->root_->serialize(os);
+void SprayPaintTree::serialize(std::ostream& os) {
+    write_code_lengths(os, this->code_lengths());
 }
 
-size_t SprayPaintTree::size() const {
-    return this->root_->calculate_size();
+size_t SprayPaintTree::size() {
+    return code_lengths_size(this->code_lengths());
 }
 
-size_t SprayPaintNode::calculate_size() const {
-    size_t size = sizeof(this->weight_) + sizeof(this->value_) + sizeof(this->leaf_);
-    bool has_left = (left_ != nullptr);
-    bool has_right = (right_ != nullptr);
-    size += sizeof(has_left) + sizeof(has_right);
-    if (has_left) size += left_->calculate_size();
-    if (has_right) size += right_->calculate_size();
-    return size;
+SprayPaintTree SprayPaintTree::deserialize(std::istream& in) {
+    return SprayPaintTree::from_code_lengths(read_code_lengths(in));
 }
 
-std::unique_ptr<SprayPaintNode> SprayPaintNode::deserialize(std::ifstream& in) {
-    auto node = std::make_unique<SprayPaintNode>();
-
-    in.read(reinterpret_cast<char*>(&node->weight_), sizeof(node->weight_));
-    in.read(reinterpret_cast<char*>(&node->value_), sizeof(node->value_));
-    in.read(reinterpret_cast<char*>(&node->leaf_), sizeof(node->leaf_));
+SprayPaintCodeLengths SprayPaintTree::code_lengths() {
+    if (this->root_ == SprayPaintTreeNode::kNoNode) {
+        throw std::runtime_error("There is not root value. Please build a huffman code tree using build() before trying to encode data.");
+    }
 
-    bool has_left = false, has_right = false;
-    in.read(reinterpret_cast<char*>(&has_left), sizeof(has_left));
-    in.read(reinterpret_cast<char*>(&has_right), sizeof(has_right));
+    SprayPaintCodeLengths lengths{};
+    const auto& root = this->nodes_[this->root_];
+    if (root.leaf()) {
+        lengths[root.value_] = 1;
+        return lengths;
+    }
 
-    if (has_left) node->left_ = deserialize(in);
-    if (has_right) node->right_ = deserialize(in);
+    // Iterative depth first search over the arena. The stack never holds more
+    // entries than there are nodes, so it lives on the stack too.
+    std::array<std::pair<uint16_t, uint8_t>, kMaxNodes> stack;
+    size_t top = 0;
+    stack[top++] = {this->root_, 0};
+    while (top > 0) {
+        auto [idx, depth] = stack[--top];
+        const auto& node = this->nodes_[idx];
+
+        if (node.leaf()) {
+            lengths[node.value_] = depth;
+            continue;
+        }
+        if (node.left_ != SprayPaintTreeNode::kNoNode) {
+            stack[top++] = {node.left_, static_cast<uint8_t>(depth + 1)};
+        }
+        if (node.right_ != SprayPaintTreeNode::kNoNode) {
+            stack[top++] = {node.right_, static_cast<uint8_t>(depth + 1)};
+        }
+    }
 
-    return node;
+    return lengths;
 }
 
-SprayPaintTree SprayPaintTree::deserialize(std::ifstream& in) {
-    SprayPaintTree spray_paint_tree;
-    auto root = std::make_unique<SprayPaintNode>();
-    spray_paint_tree.root_ = root->deserialize(in);
-    return spray_paint_tree;
-}
+SprayPaintTree SprayPaintTree::from_code_lengths(const SprayPaintCodeLengths& lengths) {
+    validate_code_lengths(lengths);
+    auto codes = canonical_codes(lengths);
 
-void generate_encodings(SprayPaintNode* node, std::unordered_map<char, std::vector<int>>& map, std::vector<int> bits) {
-    if (node == nullptr) {
-        return;
-    }
+    SprayPaintTree tree;
+    tree.root_ = tree.add_internal(0, SprayPaintTreeNode::kNoNode, SprayPaintTreeNode::kNoNode);
+    for (int sym = 0; sym < 256; ++sym) {
+        auto len = lengths[sym];
+        if (len == 0) {
+            continue;
+        }
 
-    if (node->leaf()) {
-        map[node->value()] = bits;
-        return;
+        // Walk the code from its most significant bit, creating internal nodes
+        // on the way down and hanging the leaf off the last one.
+        auto idx = tree.root_;
+        for (int b = len - 1; b > 0; --b) {
+            auto bit = (codes[sym].bits >> b) & 1;
+            auto child = bit ? tree.nodes_[idx].right_ : tree.nodes_[idx].left_;
+            if (child == SprayPaintTreeNode::kNoNode) {
+                child = tree.add_internal(0, SprayPaintTreeNode::kNoNode, SprayPaintTreeNode::kNoNode);
+                (bit ? tree.nodes_[idx].right_ : tree.nodes_[idx].left_) = child;
+            }
+            idx = child;
+        }
+        auto leaf = tree.add_leaf(0, static_cast<uint8_t>(sym));
+        ((codes[sym].bits & 1) ? tree.nodes_[idx].right_ : tree.nodes_[idx].left_) = leaf;
     }
 
-    bits.push_back(0);
-    generate_encodings(node->left_ref(), map, bits);
+    return tree;
+}
 
-    bits.back() = 1;
-    generate_encodings(node->right_ref(), map, bits);
+SprayPaintCodeTable SprayPaintTree::encode_table() {
+    return canonical_codes(this->code_lengths());
 }
 
-/* To encode data depth first search will be used
- * to generate a string of 0's and 1's associated with
- * each individual character. This may be a lot of work :thinking:
- * It's currently my best idea though.*/
 std::unordered_map<char, std::vector<int>> SprayPaintTree::encode() {
-    if (!this->root().has_value()) {
-        throw std::runtime_error("There is not root value. Please build a huffman code tree using build() before trying to encode data.");
-    }
+    auto table = this->encode_table();
+
     std::unordered_map<char, std::vector<int>> ret;
-    std::vector<int> bits;
-    auto cloned_tree = this->clone();
-    generate_encodings(cloned_tree->root_ref(), ret, bits);
+    for (int sym = 0; sym < 256; ++sym) {
+        auto [code, len] = table[sym];
+        if (len == 0) {
+            continue;
+        }
+
+        std::vector<int> bits(len);
+        for (int i = 0; i < len; ++i) {
+            bits[i] = static_cast<int>((code >> (len - 1 - i)) & 1);
+        }
+        ret.emplace(static_cast<char>(sym), std::move(bits));
+    }
 
     return ret;
 }
 
-// TODO: There seems to be a problem with serialization. For some reason the Tree in read()
-// is fucked up. I need to figure out what's going on with that.
-void SprayPaintFile::write() {
-    std::ifstream input(this->input_file_name_);
-    std::ofstream output(this->out_file_name_, std::ios::binary);
-    std::vector<int> write_buffer;
-    char write_char = 0;
-
-    auto cm = build_char_map(input);
-    this->header_.register_charset(std::move(cm));
-    this->header_.build();
-    auto encoder_lut = this->header_.encode();
-
-    // Write the header first
-    this->header_.serialize(output);
-
-    input.close();
-    std::ifstream in(this->input_file_name_);
-
-    char c;
-    while (in.get(c)) {
-        auto v = encoder_lut.find(c);
-        if (v == encoder_lut.end()) {
-            throw std::runtime_error("Character was not found, there is a problem with the encoder.");
+void validate_options(const SprayPaintOptions& options) {
+    if (options.block_size == 0 || options.block_size > kMaxBlockSize) {
+        throw std::runtime_error("Block size must be between 1 byte and 1GB.");
+    }
+    if (options.max_code_length < kMinCodeLengthLimit || options.max_code_length > kMaxCodeLength) {
+        throw std::runtime_error("Max code length must be between 8 and 63 bits.");
+    }
+    if (options.codec == SprayPaintCodec::Dictionary) {
+        if (options.dictionary == nullptr) {
+            throw std::runtime_error("The dictionary codec needs a dictionary.");
+        }
+        if (longest_code(options.dictionary->lengths()) > options.max_code_length) {
+            throw std::runtime_error("Dictionary has codes longer than the max code length.");
         }
+    }
+}
+
+SprayPaintFileHeader file_header(const SprayPaintOptions& options) {
+    auto dictionary = options.codec == SprayPaintCodec::Dictionary ? options.dictionary->id() : 0;
+    return {0, static_cast<uint32_t>(options.block_size), static_cast<uint8_t>(options.max_code_length), dictionary};
+}
 
-        for (auto bit : v->second) {
-            // The write buffer can be flushed
-            // a byte can be written to the file.
-            if (write_buffer.size() == 8) {
-                for (int i = 0; i < 8 && i < write_buffer.size(); ++i) {
-                    write_char |= (write_buffer[i] << (7 - i));
-                }
+size_t compress_block(const SprayPaintOptions& options, const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                      SprayPaintBlockScratch* scratch) {
+    if (options.codec == SprayPaintCodec::Adaptive) {
+        return compress_adaptive_block(src, size, dst, capacity, options.stats);
+    }
+    if (options.codec == SprayPaintCodec::Interleaved) {
+        return compress_interleaved_block(src, size, dst, capacity, options.max_code_length, options.stats);
+    }
+    if (options.codec == SprayPaintCodec::Context) {
+        return compress_context_block(src, size, dst, capacity, options.max_code_length, options.stats, scratch);
+    }
+    if (options.codec == SprayPaintCodec::Dictionary) {
+        return compress_dictionary_block(src, size, dst, capacity, *options.dictionary, options.max_code_length,
+                                         options.stats);
+    }
+    return compress_block(src, size, dst, capacity, options.max_code_length, options.stats);
+}
 
-                output << write_char;
+static std::vector<uint8_t> compress_block(const SprayPaintOptions& options, const uint8_t* src, size_t size) {
+    std::vector<uint8_t> block(max_compressed_block_size(size));
+    block.resize(compress_block(options, src, size, block.data(), block.size()));
+    return block;
+}
 
-                // Reset buffer and char
-                write_char = 0;
-                write_buffer.clear();
-            }
+/* OrderedBlockWriter runs block compression jobs on a pool and writes the
+ * results to `os` in submission order, followed by the end block, index and
+ * footer on finish(). At most two jobs per worker are in flight, so memory is
+ * bounded by a handful of blocks however long the input is.*/
+class OrderedBlockWriter {
+public:
+    OrderedBlockWriter(std::ostream& os, const SprayPaintOptions& options)
+            : os_(os), pool_(options.threads), stats_(options.stats) {
+        SprayPaintTimer timer(this->stats_, SprayPaintPhase::Io);
+        uint8_t header[kSprayPaintFileHeaderSize];
+        write_file_header(header, file_header(options));
+        this->os_.write(reinterpret_cast<const char*>(header), sizeof(header));
+        this->offset_ = sizeof(header);
+        this->checksum_ = crc32c(header, sizeof(header));
+    }
 
-            write_buffer.push_back(bit);
+    // `compress` runs on a worker and returns a finished block.
+    template <typename F>
+    void submit(F&& compress) {
+        this->in_flight_.push_back(this->pool_.submit(std::forward<F>(compress)));
+        if (this->in_flight_.size() >= 2 * this->pool_.size()) {
+            this->write_next();
+        }
+        // Blocks already done go out now rather than when the window fills, so
+        // on a slow pipe the output trails the input by a block or two
+        while (!this->in_flight_.empty()
+               && this->in_flight_.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            this->write_next();
         }
     }
 
-    // If our write buffer is at a bad offset (i.e. less then 8 bits)
-    // We will need to do a second loop through to pad the char
-    // This padding offset will be in the metadata for our file that we write
-    if (!write_buffer.empty()) {
-        int offset = 0;
-        for (int i = 0; i < 8; ++i) {
-            if ((i + 1) > write_buffer.size()) {
-                ++offset;
-                write_char |= (0 << (7 - i));
-            } else {
-                write_char |= (write_buffer[i] << (7 - i));
-            }
+    void finish() {
+        while (!this->in_flight_.empty()) {
+            this->write_next();
         }
-        output << write_char;
-
-        // Write the offset as the last byte of the file
-        // This will be used when reading in the file
-        write_char = offset;
-        output << write_char;
+        SprayPaintTimer timer(this->stats_, SprayPaintPhase::Io);
+        write_block_index(this->os_, this->offset_, this->index_, this->checksum_);
+        if (!this->os_) {
+            throw std::runtime_error("Failed to write compressed output.");
+        }
+    }
+private:
+    void write_next() {
+        auto block = this->in_flight_.front().get();
+        this->in_flight_.pop_front();
+
+        auto header = read_block_header(block.data());
+        this->index_.push_back({this->offset_, this->raw_offset_, header.raw_size, static_cast<uint32_t>(block.size())});
+        {
+            SprayPaintTimer timer(this->stats_, SprayPaintPhase::Checksum);
+            this->checksum_ = crc32c(block.data(), block.size(), this->checksum_);
+        }
+        SprayPaintTimer timer(this->stats_, SprayPaintPhase::Io);
+        this->os_.write(reinterpret_cast<const char*>(block.data()), block.size());
+        this->os_.flush();
+        this->offset_ += block.size();
+        this->raw_offset_ += header.raw_size;
     }
 
-    in.close();
-    output.close();
+    std::ostream& os_;
+
+    ThreadPool pool_;
+
+    SprayPaintStats* stats_;
+
+    std::deque<std::future<std::vector<uint8_t>>> in_flight_;
+
+    std::vector<SprayPaintIndexEntry> index_;
+
+    uint64_t offset_ = 0;
+
+    uint64_t raw_offset_ = 0;
+
+    // CRC32C of everything written so far, for the footer.
+    uint32_t checksum_ = 0;
+};
+
+void SprayPaintFile::write() {
+    auto* stats = this->options_.stats;
+    auto input = [&] {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        auto file = MappedFile::open(this->input_file_name_);
+        file.advise_sequential();
+        return file;
+    }();
+
+    // Mapped at the worst case size, then cut down to what was written
+    auto output = [&] {
+        auto bound = compress_bound(input.size(), this->options_);
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        return MappedFile::create(this->out_file_name_, bound);
+    }();
+    auto size = compress(input.bytes(), output.bytes(), this->options_);
+
+    SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+    output.truncate(size);
 }
 
 void SprayPaintFile::read() {
-    this->header_.reset();
+    auto* stats = this->options_.stats;
+    auto input = [&] {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        return MappedFile::open(this->input_file_name_);
+    }();
+
+    auto output = [&] {
+        auto size = decompressed_size(input.bytes());
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        return MappedFile::create(this->out_file_name_, size);
+    }();
+    decompress(input.bytes(), output.bytes(), this->options_);
+}
 
-    std::ifstream input(this->input_file_name_, std::ios::binary);
-    std::ofstream output(this->out_file_name_);
+void SprayPaintFile::read_range(uint64_t offset, uint64_t length) {
+    auto* stats = this->options_.stats;
+    auto input = [&] {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        return MappedFile::open(this->input_file_name_);
+    }();
 
-    this->header_ = SprayPaintTree::deserialize(input);
-    auto head = std::make_unique<SprayPaintNode>(this->header_.clone()->root().value());
-    auto tail = std::make_unique<SprayPaintNode>(this->header_.clone()->root().value());
+    auto raw_size = decompressed_size(input.bytes());
+    if (offset > raw_size) {
+        throw std::runtime_error("Range starts past the end of the decompressed data.");
+    }
+    length = std::min(length, raw_size - offset);
 
-    // get length of file:
-    input.seekg (0, input.end);
-    int length = input.tellg();
+    auto output = [&] {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        return MappedFile::create(this->out_file_name_, length);
+    }();
+    decompress_range(input.bytes(), offset, output.bytes(), this->options_);
+}
 
-    // Need to read offset bit
-    char end_bit;
-    input.seekg(-1, std::ios::end);
-    input.get(end_bit);
+void SprayPaintFile::verify() {
+    auto* stats = this->options_.stats;
+    auto input = [&] {
+        SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+        return MappedFile::open(this->input_file_name_);
+    }();
+    verify_compressed(input.bytes(), this->options_);
+}
 
-    auto tree_size = this->header_.size();
-    input.seekg(tree_size, std::ios::beg);
+void SprayPaintStream::write(std::istream& in, std::ostream& out) {
+    validate_options(this->options_);
+    auto* stats = this->options_.stats;
+
+    // Workers hand their input chunk back once its block is compressed. The
+    // writer keeps at most a window of blocks in flight, so the stream only
+    // ever allocates (and zero fills) a few chunks, not one per block.
+    std::mutex free_mutex;
+    std::vector<std::vector<uint8_t>> free_chunks;
+    auto writer = OrderedBlockWriter(out, this->options_);
 
-    char c = 0;
-    int curr_byte = tree_size;
     while (true) {
-        // Increment current byte
-        input.get(c);
-        ++curr_byte;
-        std::bitset<8> as_bits(c);
-        std::cout << "curr bits: " << as_bits << std::endl;
-        if ((curr_byte - length) > (length - 1)) {
-            break;
-        } else if ((curr_byte - (length - 1)) == 0) {
-            for (int i = as_bits.size() - 1; i >= (0 + (int)end_bit); --i) {
-                if (as_bits[i] == 0) {
-                    if (tail->left_ref()->leaf()) {
-                        output << tail->left_ref()->value();
-                        tail = head->clone();
-                        continue;
-                    } else {
-                        tail = tail->left();
-                        continue;
-                    }
-                } else if (as_bits[i] == 1) {
-                    if (tail->right_ref()->leaf()) {
-                        output << tail->right_ref()->value();
-                        tail = head->clone();
-                        continue;
-                    } else {
-                        tail = tail->right();
-                        continue;
-                    }
-                }
+        std::vector<uint8_t> chunk;
+        {
+            std::lock_guard<std::mutex> lock(free_mutex);
+            if (!free_chunks.empty()) {
+                chunk = std::move(free_chunks.back());
+                free_chunks.pop_back();
             }
+        }
+        chunk.resize(this->options_.block_size);
+
+        // read() keeps pulling from the pipe until the block is full or the input ends
+        {
+            SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+            in.read(reinterpret_cast<char*>(chunk.data()), chunk.size());
+        }
+        auto size = static_cast<size_t>(in.gcount());
+        if (size == 0) {
             break;
         }
-        // Extracting individual bits from a byte
-        // Char is a byte-sized type so it has 8 bits
-        for (int i = as_bits.size() - 1; i >= 0; --i) {
-            if (as_bits[i] == 0) {
-                if (tail->left_ref()->leaf()) {
-                    output << tail->left_ref()->value();
-                    tail = head->clone();
-                    continue;
-                } else {
-                    tail = tail->left();
-                    continue;
-                }
-            } else if (as_bits[i] == 1) {
-                if (tail->right_ref()->leaf()) {
-                    output << tail->right_ref()->value();
-                    tail = head->clone();
-                    continue;
-                } else {
-                    tail = tail->right();
-                    continue;
-                }
+
+        writer.submit([chunk = std::move(chunk), size, options = this->options_, &free_mutex, &free_chunks]() mutable {
+            auto block = compress_block(options, chunk.data(), size);
+            std::lock_guard<std::mutex> lock(free_mutex);
+            free_chunks.push_back(std::move(chunk));
+            return block;
+        });
+    }
+
+    if (in.bad()) {
+        throw std::runtime_error("Failed to read input stream.");
+    }
+    writer.finish();
+}
+
+/* Blocks are read front to back until the end block, so no seeking is needed.
+ * Decoding still fans out across the pool with a bounded window of blocks in
+ * flight. The index and footer are read last, only to check the block count
+ * and the file checksum, which is built up over every byte as it arrives.*/
+void SprayPaintStream::read(std::istream& in, std::ostream& out) {
+    this->read_blocks(in, &out);
+    if (!out) {
+        throw std::runtime_error("Failed to write decompressed output.");
+    }
+}
+
+void SprayPaintStream::verify(std::istream& in) {
+    this->read_blocks(in, nullptr);
+}
+
+void SprayPaintStream::read_blocks(std::istream& in, std::ostream* out) {
+    auto* stats = this->options_.stats;
+    uint32_t checksum = 0;
+    auto read_exact = [&in, &checksum, stats](uint8_t* dst, size_t size) {
+        {
+            SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+            if (!in.read(reinterpret_cast<char*>(dst), size)) {
+                throw std::runtime_error("Compressed stream ended unexpectedly.");
             }
         }
+        SprayPaintTimer timer(stats, SprayPaintPhase::Checksum);
+        checksum = crc32c(dst, size, checksum);
+    };
+
+    uint8_t file_header[kSprayPaintFileHeaderSize];
+    read_exact(file_header, sizeof(file_header));
+    auto header = read_file_header(file_header, sizeof(file_header));
+    auto* dictionary = file_dictionary(header, this->options_.dictionary);
+
+    auto pool = ThreadPool(this->options_.threads);
+    std::deque<std::future<std::vector<uint8_t>>> in_flight;
+    auto write_next = [&]() {
+        auto block = in_flight.front().get();
+        in_flight.pop_front();
+        if (out != nullptr) {
+            SprayPaintTimer timer(stats, SprayPaintPhase::Io);
+            out->write(reinterpret_cast<const char*>(block.data()), block.size());
+        }
+    };
+
+    uint64_t block_count = 0;
+    uint64_t raw_size = 0;
+    while (true) {
+        uint8_t block_header[kBlockHeaderSize];
+        read_exact(block_header, sizeof(block_header));
+        auto bh = read_block_header(block_header);
+        if (bh.type == SprayPaintBlockType::End) {
+            break;
+        }
+        if (bh.raw_size > header.block_size || bh.payload_size > max_block_payload_size(bh.raw_size)) {
+            throw std::runtime_error("Block header is corrupt.");
+        }
+
+        std::vector<uint8_t> payload(bh.payload_size);
+        read_exact(payload.data(), payload.size());
+        in_flight.push_back(pool.submit([bh, payload = std::move(payload), max_code_length = header.max_code_length,
+                                         stats, dictionary] {
+            std::vector<uint8_t> block(bh.raw_size);
+            decompress_block(bh, payload.data(), block.data(), max_code_length, stats, nullptr, dictionary);
+            return block;
+        }));
+        ++block_count;
+        raw_size += bh.raw_size;
+
+        if (in_flight.size() >= 2 * pool.size()) {
+            write_next();
+        }
     }
 
-    output.close();
+    // One index entry per block, then the footer
+    uint8_t entry[kIndexEntrySize];
+    for (uint64_t i = 0; i < block_count; ++i) {
+        read_exact(entry, sizeof(entry));
+    }
+    uint8_t footer[kFooterSize];
+    read_exact(footer, kFooterChecksumOffset);
+    auto file_checksum = checksum;
+    read_exact(footer + kFooterChecksumOffset, kFooterSize - kFooterChecksumOffset);
+    auto f = read_footer(footer);
+    if (f.block_count != block_count || f.raw_size != raw_size) {
+        throw std::runtime_error("Block index footer does not match the blocks in the stream.");
+    }
+    if (f.checksum != file_checksum) {
+        throw std::runtime_error("File checksum mismatch, the compressed file is corrupt.");
+    }
+
+    while (!in_flight.empty()) {
+        write_next();
+    }
 }
+
@@ -2,18 +2,28 @@
 
 #include "heap/max_heap.h"
 #include "heap/min_heap.h"
+#include "canonical.h"
+#include "block.h"
+#include "histogram.h"
 
 #include <unordered_map>
 #include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
 #include <cassert>
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <optional>
 #include <utility>
+#include <array>
+
 
 std::unordered_map<char, int> build_char_map(std::ifstream&);
 
+std::unordered_map<char, int> build_char_map(const uint8_t* data, size_t size);
+
 class SprayPaintNode {
 public:
     SprayPaintNode() = default;
@@ -54,8 +64,7 @@ public:
 
 
     std::unique_ptr<SprayPaintNode> clone() {
-        auto spn = SprayPaintNode{*this};
-        return std::make_unique<SprayPaintNode>(spn);
+        return std::make_unique<SprayPaintNode>(*this);
     }
 
     std::unique_ptr<SprayPaintNode> left() {
@@ -98,17 +107,12 @@ public:
         return this->weight_ == cmp.weight_;
     }
 
-    void serialize(std::ofstream& os);
-
-    std::unique_ptr<SprayPaintNode> deserialize(std::ifstream& is);
-
-    size_t calculate_size() const;
 protected:
-    int weight_;
+    int weight_ = 0;
 
-    bool leaf_;
+    bool leaf_ = false;
 
-    char value_;
+    char value_ = 0;
 
     std::unique_ptr<SprayPaintNode> left_;
 
@@ -117,7 +121,7 @@ protected:
 
 class InternalNode : public SprayPaintNode {
 public:
-    explicit InternalNode(int weight, std::unique_ptr<SprayPaintNode> l, std::unique_ptr<SprayPaintNode> r) : SprayPaintNode(*this) {
+    explicit InternalNode(int weight, std::unique_ptr<SprayPaintNode> l, std::unique_ptr<SprayPaintNode> r) : SprayPaintNode() {
         this->weight_ = weight;
         this->leaf_ = false;
         this->right_ = std::move(r);
@@ -127,140 +131,248 @@ public:
 
 class LeafNode : public SprayPaintNode {
 public:
-    LeafNode(int weight, char value) : SprayPaintNode(*this) {
+    LeafNode(int weight, char value) : SprayPaintNode() {
         this->weight_ = weight;
         this->leaf_ = true;
         this->value_ = value;
     };
 };
 
-class SprayPaintTree {
+/* Node of a SprayPaintTree. Nodes live in the tree's fixed size arena and refer
+ * to their children by index, so building or copying a tree never allocates.*/
+class SprayPaintTreeNode {
+    friend class SprayPaintTree;
 public:
-    SprayPaintTree() {
-        this->root_ = nullptr;
-    };
+    // Child index of a leaf, or of an unused slot in an incomplete code.
+    static constexpr uint16_t kNoNode = 0xFFFF;
 
-    SprayPaintTree(const SprayPaintTree& t) {
-        this->root_ = t.root_->clone();
-        this->charset_ = t.charset_;
+    [[nodiscard]] bool leaf() const {
+        return this->leaf_;
     }
 
-    SprayPaintTree(int weight, char val) {
-        auto ln = LeafNode(weight, val);
-        this->root_ = std::move(std::make_unique<LeafNode>(std::move(ln)));
-    };
+    [[nodiscard]] uint64_t weight() const {
+        return this->weight_;
+    }
 
-    SprayPaintTree(SprayPaintNode l, SprayPaintNode r) {
-        int weight = l.weight() + r.weight();
-        auto in = InternalNode(weight,
-                               std::make_unique<SprayPaintNode>(l),
-                               std::make_unique<SprayPaintNode>(r));
+    [[nodiscard]] char value() const {
+        return static_cast<char>(this->value_);
+    }
 
-        this->root_ = std::move(std::make_unique<InternalNode>(std::move(in)));
-    };
+    [[nodiscard]] uint16_t left() const {
+        return this->left_;
+    }
 
+    [[nodiscard]] uint16_t right() const {
+        return this->right_;
+    }
+private:
+    uint64_t weight_ = 0;
 
-    // Explicitly default move operations
-    SprayPaintTree(SprayPaintTree&&) noexcept = default;
-    SprayPaintTree& operator=(SprayPaintTree&&) noexcept = default;
+    uint16_t left_ = kNoNode;
 
-    // Prevent copying if not needed
-    SprayPaintTree& operator=(const SprayPaintTree&) = delete;
+    uint16_t right_ = kNoNode;
 
-    [[nodiscard]] std::unique_ptr<SprayPaintTree> clone() const {
-        auto spt = SprayPaintTree{*this};
-        return std::make_unique<SprayPaintTree>(spt);
-    }
+    uint8_t value_ = 0;
 
-    friend std::ostream& operator<<(std::ostream& stream, const SprayPaintTree& o) {
-        stream << "weight=" << o.root_->weight() << " value=" << o.root_->value();
-        return stream;
-    }
+    bool leaf_ = false;
+};
 
-    bool operator>(const SprayPaintTree& cmp) const {
-        if (this->root_ && cmp.root_) {
-            return (this->root_->weight()) > (cmp.root_->weight());
-        }
-        return this->root_ != nullptr;
-    }
+enum class SprayPaintBuildStrategy {
+    // Merge through a DaryMinHeap, O(n log n).
+    Heap,
 
-    bool operator>=(const SprayPaintTree& cmp) const {
-        if (this->root_ && cmp.root_) {
-            return (this->root_->weight()) >= (cmp.root_->weight());
-        }
-        return this->root_ != nullptr;
-    }
+    // Sort the counts once, then merge from two FIFO queues in O(n).
+    TwoQueue,
+};
 
-    bool operator<(const SprayPaintTree& cmp) const {
-        if (this->root_ && cmp.root_) {
-            return (this->root_->weight()) < (cmp.root_->weight());
-        }
-        return cmp.root_ != nullptr;
-    }
+/* SprayPaintTree stores its nodes in a fixed array sized for the largest tree
+ * a byte alphabet can produce, with uint16_t child indices instead of owning
+ * pointers. build() merges indices on a heap of {weight, node} pairs, so a
+ * tree is built with no per node allocations and copying one is a memcpy.*/
+class SprayPaintTree {
+public:
+    // Huffman trees over bytes have at most 256 leaves and 255 internal nodes.
+    static constexpr size_t kMaxNodes = 511;
 
-    bool operator<=(const SprayPaintTree& cmp) const {
-        if (this->root_ && cmp.root_) {
-            return (this->root_->weight()) <= (cmp.root_->weight());
-        }
-        return cmp.root_ != nullptr;
+    SprayPaintTree() = default;
+
+    SprayPaintTree(uint64_t weight, char val) {
+        this->root_ = this->add_leaf(weight, static_cast<uint8_t>(val));
+    };
+
+    [[nodiscard]] std::unique_ptr<SprayPaintTree> clone() const {
+        return std::make_unique<SprayPaintTree>(*this);
     }
 
-    bool operator==(const SprayPaintTree& cmp) const {
-        if (this->root_ && cmp.root_) {
-            return (this->root_->weight()) == (cmp.root_->weight());
-        }
-        return this->root_ == nullptr && cmp.root_ == nullptr;
+    friend std::ostream& operator<<(std::ostream& stream, const SprayPaintTree& o) {
+        const auto& root = o.nodes_[o.root_];
+        stream << "weight=" << root.weight() << " value=" << root.value();
+        return stream;
     }
 
-    std::optional<SprayPaintNode> root() {
-        auto r = this->root_.get();
-        if (r == nullptr) {
+    std::optional<SprayPaintTreeNode> root() const {
+        if (this->root_ == SprayPaintTreeNode::kNoNode) {
             return {};
         }
+        return this->nodes_[this->root_];
+    }
 
-        return std::make_optional(*r);
+    // Node at `idx` as returned by left()/right() of its parent.
+    [[nodiscard]] const SprayPaintTreeNode& node(uint16_t idx) const {
+        return this->nodes_[idx];
     }
 
-    SprayPaintNode* root_ref() {
-        return this->root_.get();
+    [[nodiscard]] size_t node_count() const {
+        return this->node_count_;
     }
 
     // Reset will destroy the tree and completely reset it. This is destructive!
     void reset() {
-        this->root_ = nullptr;
+        this->node_count_ = 0;
+        this->root_ = SprayPaintTreeNode::kNoNode;
     };
 
-    void build();
+    void build(SprayPaintBuildStrategy strategy = SprayPaintBuildStrategy::TwoQueue);
+
+    // Canonical {code, length} for every byte value, 0 length for bytes not in
+    // the tree. This is what the encoder consumes.
+    SprayPaintCodeTable encode_table();
 
+    // Same codes as encode_table() with each code spelled out as a vector of bits.
     std::unordered_map<char, std::vector<int>> encode();
 
-    void register_charset(std::unordered_map<char, int> charset){
-        this->charset_.emplace(std::move(charset));
+    // Depth of every leaf in the tree. A tree with a single leaf still gets a
+    // 1 bit code so that every symbol takes up space in the bitstream.
+    SprayPaintCodeLengths code_lengths();
+
+    // Rebuilds the canonical code tree for a set of code lengths. Weights are
+    // not stored on disk so every node in the new tree has a weight of 0.
+    static SprayPaintTree from_code_lengths(const SprayPaintCodeLengths& lengths);
+
+    void register_charset(const std::unordered_map<char, int>& charset){
+        SprayPaintHistogram counts{};
+        for (auto& [c, count] : charset) {
+            counts[static_cast<uint8_t>(c)] = count;
+        }
+        this->charset_.emplace(counts);
     };
 
-    void serialize(std::ofstream& os);
+    void register_charset(const SprayPaintHistogram& counts) {
+        this->charset_.emplace(counts);
+    }
+
+    // Writes the code length header, see write_code_lengths().
+    void serialize(std::ostream& os);
 
-    static SprayPaintTree deserialize(std::ifstream& is);
+    static SprayPaintTree deserialize(std::istream& is);
 
-    size_t size() const;
+    // Size in bytes of the serialized header.
+    size_t size();
 private:
-    std::unique_ptr<SprayPaintNode> root_;
+    uint16_t add_node(const SprayPaintTreeNode& node);
+
+    uint16_t add_leaf(uint64_t weight, uint8_t value);
+
+    uint16_t add_internal(uint64_t weight, uint16_t left, uint16_t right);
+
+    void build_heap();
 
-    std::optional<std::unordered_map<char, int>> charset_;
+    void build_two_queue();
+
+    std::array<SprayPaintTreeNode, kMaxNodes> nodes_{};
+
+    uint16_t node_count_ = 0;
+
+    uint16_t root_ = SprayPaintTreeNode::kNoNode;
+
+    std::optional<SprayPaintHistogram> charset_;
 };
 
+struct SprayPaintOptions {
+    // Input bytes per independently coded block.
+    size_t block_size = kDefaultBlockSize;
+
+    // Worker threads used for compression and decompression, 0 means one per core.
+    unsigned threads = 0;
+
+    // Longest code the compressor may use, between kMinCodeLengthLimit and
+    // kMaxCodeLength bits. Recorded in the file header.
+    unsigned max_code_length = kDefaultMaxCodeLength;
+
+    // How the compressor codes blocks. Files can be read without knowing it,
+    // every block records its own type.
+    SprayPaintCodec codec = SprayPaintCodec::Static;
+
+    // Phase timings and counters are added here when set. Must outlive the job.
+    SprayPaintStats* stats = nullptr;
+
+    // Codes for the Dictionary codec, and needed to read files written with
+    // one. Must outlive the job.
+    const SprayPaintDictionary* dictionary = nullptr;
+};
+
+// Throws if any option is out of range.
+void validate_options(const SprayPaintOptions& options);
+
+// Header of a file written with these options.
+SprayPaintFileHeader file_header(const SprayPaintOptions& options);
+
+// Compresses one block at dst with the codec and code length limit in
+// options, see compress_block() in block.h.
+size_t compress_block(const SprayPaintOptions& options, const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+                      SprayPaintBlockScratch* scratch = nullptr);
+
+/* SprayPaintFile maps its input and output files and hands them to the
+ * in memory API in buffer.h, which splits the input into blocks and codes
+ * them on a thread pool, each with its own histogram and tree.
+ *
+ * Compression maps the output at compress_bound() and cuts it down to the
+ * compressed size afterwards. Decompression maps the output at its final size
+ * and decodes every block straight into its slice of the output.*/
 class SprayPaintFile {
 public:
-    SprayPaintFile(SprayPaintTree tree, std::string  out, std::string in)
-            : header_(std::move(tree)), out_file_name_(std::move(out)), input_file_name_(std::move(in)) {}
+    SprayPaintFile(std::string out, std::string in, SprayPaintOptions options = {})
+            : out_file_name_(std::move(out)), input_file_name_(std::move(in)), options_(options) {}
 
     void write();
 
     void read();
-private:
-    SprayPaintTree header_;
 
+    // Decompresses `length` bytes starting at `offset` of the original data. The
+    // range is clamped to the end of the data; an offset past the end throws.
+    // Every decoded block is checked against its checksum, the file checksum
+    // only when the range covers the whole file.
+    void read_range(uint64_t offset, uint64_t length);
+
+    // Checks the file checksum and decodes every block to check its checksum,
+    // without writing any output. Throws on the first mismatch.
+    void verify();
+private:
     std::string out_file_name_;
 
     std::string input_file_name_;
+
+    SprayPaintOptions options_;
+};
+
+
+/* SprayPaintStream produces and consumes the same format as SprayPaintFile but
+ * never seeks, so it works on pipes and stdin/stdout. Memory use is bounded by
+ * a few blocks per worker thread; compression keeps the block index (24 bytes
+ * per block) in memory to write it at the end.*/
+class SprayPaintStream {
+public:
+    explicit SprayPaintStream(SprayPaintOptions options = {}) : options_(options) {}
+
+    void write(std::istream& in, std::ostream& out);
+
+    void read(std::istream& in, std::ostream& out);
+
+    // Same checks as read(), without writing any output.
+    void verify(std::istream& in);
+private:
+    // Decodes every block of in, writing them to out unless it is null.
+    void read_blocks(std::istream& in, std::ostream* out);
+
+    SprayPaintOptions options_;
 };
\ No newline at end of file
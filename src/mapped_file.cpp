@@ -0,0 +1,119 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::runtime_error mapping_error(const std::string& what, const std::string& path) {
+    return std::runtime_error(what + " '" + path + "': " + std::strerror(errno));
+}
+
+MappedFile MappedFile::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw mapping_error("Could not open", path);
+    }
+
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw mapping_error("Could not stat", path);
+    }
+
+    // mmap rejects zero length mappings, an empty file is just an empty span
+    auto size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        return {fd, nullptr, 0};
+    }
+
+    auto data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        throw mapping_error("Could not map", path);
+    }
+    return {fd, static_cast<uint8_t*>(data), size};
+}
+
+MappedFile MappedFile::create(const std::string& path, size_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw mapping_error("Could not create", path);
+    }
+
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        throw mapping_error("Could not resize", path);
+    }
+
+    if (size == 0) {
+        return {fd, nullptr, 0};
+    }
+
+    auto data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        throw mapping_error("Could not map", path);
+    }
+    return {fd, static_cast<uint8_t*>(data), size};
+}
+
+MappedFile::MappedFile(MappedFile&& mf) noexcept
+        : fd_(std::exchange(mf.fd_, -1)), data_(std::exchange(mf.data_, nullptr)), size_(std::exchange(mf.size_, 0)) {}
+
+MappedFile& MappedFile::operator=(MappedFile&& mf) noexcept {
+    if (this != &mf) {
+        this->close();
+        this->fd_ = std::exchange(mf.fd_, -1);
+        this->data_ = std::exchange(mf.data_, nullptr);
+        this->size_ = std::exchange(mf.size_, 0);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    this->close();
+}
+
+void MappedFile::advise_sequential() const {
+    if (this->data_ != nullptr) {
+        ::madvise(this->data_, this->size_, MADV_SEQUENTIAL);
+    }
+}
+
+void MappedFile::truncate(size_t size) {
+    if (size >= this->size_) {
+        return;
+    }
+
+    auto page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    auto keep = (size + page - 1) / page * page;
+    if (keep < this->size_) {
+        ::munmap(this->data_ + keep, this->size_ - keep);
+    }
+    if (keep == 0) {
+        this->data_ = nullptr;
+    }
+    this->size_ = size;
+
+    if (::ftruncate(this->fd_, static_cast<off_t>(size)) != 0) {
+        throw std::runtime_error(std::string("Could not resize mapped file: ") + std::strerror(errno));
+    }
+}
+
+void MappedFile::close() {
+    if (this->data_ != nullptr) {
+        ::munmap(this->data_, this->size_);
+        this->data_ = nullptr;
+    }
+    if (this->fd_ >= 0) {
+        ::close(this->fd_);
+        this->fd_ = -1;
+    }
+    this->size_ = 0;
+}
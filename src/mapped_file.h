@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <string>
+
+/* MappedFile is an RAII wrapper around a memory mapped file. Reading a mapping
+ * is a plain memory access, so there is no per character iostream overhead
+ * and no read() syscalls; the kernel pages the file in as it is touched.*/
+class MappedFile {
+public:
+    // Maps an existing file read only.
+    static MappedFile open(const std::string& path);
+
+    // Creates (or truncates) a file of exactly `size` bytes and maps it read/write.
+    static MappedFile create(const std::string& path, size_t size);
+
+    MappedFile(MappedFile&& mf) noexcept;
+    MappedFile& operator=(MappedFile&& mf) noexcept;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile();
+
+    // Tells the kernel the mapping will be read front to back so it can read
+    // ahead aggressively and drop pages behind us.
+    void advise_sequential() const;
+
+    // Shrinks a file made by create() to its first `size` bytes. Pages past
+    // the new end are unmapped, the rest of the mapping stays where it is.
+    void truncate(size_t size);
+
+    [[nodiscard]] uint8_t* data() {
+        return this->data_;
+    }
+
+    [[nodiscard]] const uint8_t* data() const {
+        return this->data_;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return this->size_;
+    }
+
+    [[nodiscard]] std::span<std::byte> bytes() {
+        return std::as_writable_bytes(std::span(this->data_, this->size_));
+    }
+
+    [[nodiscard]] std::span<const std::byte> bytes() const {
+        return std::as_bytes(std::span(this->data_, this->size_));
+    }
+private:
+    MappedFile(int fd, uint8_t* data, size_t size) : fd_(fd), data_(data), size_(size) {}
+
+    void close();
+
+    int fd_;
+
+    uint8_t* data_;
+
+    size_t size_;
+};
@@ -0,0 +1,94 @@
+#include "package_merge.h"
+
+#include <algorithm>
+#include <bitset>
+#include <stdexcept>
+
+/* Every list holds "coins": the leaves (one per symbol, sorted by weight) merged
+ * with packages made by pairing up consecutive items of the list one level
+ * deeper. Picking the 2n - 2 cheapest items of the top list gives the optimal
+ * length limited code; a symbol's length is the number of levels at which its
+ * leaf ends up picked.
+ *
+ * Within a list leaves appear in weight order, so the leaves picked at a level
+ * are always the lightest m of them, and the m picked items of a level only
+ * depend on how many packages were among the picked items of the level above
+ * (each package expands to two items below). That means only one bit per item,
+ * "is this a package", has to be kept per level instead of the contents of
+ * every package.*/
+SprayPaintCodeLengths package_merge(const SprayPaintHistogram& counts, unsigned max_length) {
+    if (max_length < kMinCodeLengthLimit || max_length > kMaxCodeLength) {
+        throw std::runtime_error("Max code length must be between 8 and 63 bits.");
+    }
+
+    std::array<uint64_t, 256> weights{};
+    std::array<uint8_t, 256> symbols{};
+    size_t n = 0;
+    for (int sym = 0; sym < 256; ++sym) {
+        if (counts[sym] != 0) {
+            symbols[n++] = static_cast<uint8_t>(sym);
+        }
+    }
+    std::sort(symbols.begin(), symbols.begin() + n, [&counts](uint8_t a, uint8_t b) {
+        return counts[a] < counts[b] || (counts[a] == counts[b] && a < b);
+    });
+    for (size_t i = 0; i < n; ++i) {
+        weights[i] = counts[symbols[i]];
+    }
+
+    SprayPaintCodeLengths lengths{};
+    if (n == 0) {
+        throw std::runtime_error("Cannot build a code without any symbols.");
+    }
+    if (n == 1) {
+        lengths[symbols[0]] = 1;
+        return lengths;
+    }
+
+    // is_package[level][i]: item i of the list at `level` (0 is the top, the
+    // list codes of length 1 draw from) is a package rather than a leaf. All
+    // of it fits in 4KB, so it lives on the stack like the item lists.
+    std::array<std::bitset<2 * 256>, kMaxCodeLength> is_package;
+    std::array<uint64_t, 2 * 256> lists[2];
+    auto* items = lists[0].data();
+    auto* merged = lists[1].data();
+    size_t item_count = 0;
+
+    for (auto level = static_cast<int>(max_length) - 1; level >= 0; --level) {
+        // Pair up the previous (deeper) list into packages and merge them with the leaves
+        auto packages = item_count / 2;
+        size_t leaf = 0, pkg = 0, out = 0;
+        while (leaf < n || pkg < packages) {
+            auto package_weight = pkg < packages ? items[2 * pkg] + items[2 * pkg + 1] : 0;
+            if (pkg == packages || (leaf < n && weights[leaf] <= package_weight)) {
+                is_package[level][out] = false;
+                merged[out++] = weights[leaf++];
+            } else {
+                is_package[level][out] = true;
+                merged[out++] = package_weight;
+                ++pkg;
+            }
+        }
+        std::swap(items, merged);
+        item_count = out;
+    }
+
+    // Walk back down from the top, expanding the picked packages level by level
+    size_t picked = 2 * n - 2;
+    for (unsigned level = 0; level < max_length && picked > 0; ++level) {
+        size_t packages = 0;
+        for (size_t i = 0; i < picked; ++i) {
+            packages += is_package[level][i];
+        }
+        for (size_t i = 0; i < picked - packages; ++i) {
+            ++lengths[symbols[i]];
+        }
+        picked = 2 * packages;
+    }
+
+    return lengths;
+}
+
+uint8_t longest_code(const SprayPaintCodeLengths& lengths) {
+    return *std::max_element(lengths.begin(), lengths.end());
+}
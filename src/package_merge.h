@@ -0,0 +1,16 @@
+#pragma once
+
+#include "canonical.h"
+#include "histogram.h"
+
+// Shortest cap that can still give all 256 byte values a code.
+constexpr unsigned kMinCodeLengthLimit = 8;
+
+/* Optimal code lengths for `counts` with no code longer than max_length bits,
+ * built with the package-merge algorithm (Larmore & Hirschberg). Runs in
+ * O(max_length * n) for n distinct symbols. Throws if max_length is outside
+ * [kMinCodeLengthLimit, kMaxCodeLength].*/
+SprayPaintCodeLengths package_merge(const SprayPaintHistogram& counts, unsigned max_length);
+
+// Longest code in lengths.
+uint8_t longest_code(const SprayPaintCodeLengths& lengths);
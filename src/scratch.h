@@ -0,0 +1,22 @@
+#pragma once
+
+#include "context.h"
+#include "decoder.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* Memory the block coders would otherwise allocate for every block: the
+ * Context codec's counts and clustering state, its decoders, and a block
+ * sized buffer for decodes that only keep part of a block (range reads) or
+ * none of it (verification). Each part is allocated the first time it is
+ * needed and reused by every block after that, so a caller coding many blocks
+ * on one thread pays for it once. Not thread safe, use one per thread.*/
+struct SprayPaintBlockScratch {
+    std::unique_ptr<SprayPaintContextScratch> context;
+
+    std::vector<SprayPaintDecoder> decoders;
+
+    std::vector<uint8_t> block;
+};
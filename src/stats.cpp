@@ -0,0 +1,71 @@
+#include "stats.h"
+
+#include <iomanip>
+
+static const char* phase_name(size_t phase) {
+    switch (static_cast<SprayPaintPhase>(phase)) {
+        case SprayPaintPhase::Io: return "io";
+        case SprayPaintPhase::Histogram: return "histogram";
+        case SprayPaintPhase::TreeBuild: return "tree_build";
+        case SprayPaintPhase::Header: return "header";
+        case SprayPaintPhase::Encode: return "encode";
+        case SprayPaintPhase::DecoderBuild: return "decoder_build";
+        case SprayPaintPhase::Decode: return "decode";
+        case SprayPaintPhase::Checksum: return "checksum";
+        case SprayPaintPhase::Total: return "total";
+    }
+    return "unknown";
+}
+
+static double to_ms(const std::atomic<uint64_t>& ns) {
+    return static_cast<double>(ns.load(std::memory_order_relaxed)) / 1e6;
+}
+
+static double bits_per_symbol(const SprayPaintStats& stats) {
+    auto symbols = stats.counter(SprayPaintCounter::Symbols);
+    return symbols == 0 ? 0.0 : static_cast<double>(stats.counter(SprayPaintCounter::Bits)) / symbols;
+}
+
+void SprayPaintStats::print(std::ostream& os) const {
+    auto flags = os.flags();
+    os << std::fixed << std::setprecision(2);
+    os << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms" << "\n";
+    for (size_t phase = 0; phase < kSprayPaintPhaseCount; ++phase) {
+        if (this->wall_ns[phase] == 0 && this->cpu_ns[phase] == 0) {
+            continue;
+        }
+        os << std::left << std::setw(16) << phase_name(phase) << std::right
+           << std::setw(12) << to_ms(this->wall_ns[phase]) << std::setw(12) << to_ms(this->cpu_ns[phase]) << "\n";
+    }
+
+    auto bytes_in = this->counter(SprayPaintCounter::BytesIn);
+    auto bytes_out = this->counter(SprayPaintCounter::BytesOut);
+    os << "blocks           " << this->counter(SprayPaintCounter::Blocks) << "\n"
+       << "stored blocks    " << this->counter(SprayPaintCounter::StoredBlocks) << "\n"
+       << "run blocks       " << this->counter(SprayPaintCounter::RunBlocks) << "\n"
+       << "bytes in         " << bytes_in << "\n"
+       << "bytes out        " << bytes_out << "\n"
+       << "bits per symbol  " << bits_per_symbol(*this) << "\n"
+       << "max code length  " << this->max_code_length << "\n";
+    os.flags(flags);
+}
+
+void SprayPaintStats::print_json(std::ostream& os) const {
+    auto flags = os.flags();
+    os << std::fixed << std::setprecision(3);
+    os << "{\"phases\":{";
+    for (size_t phase = 0; phase < kSprayPaintPhaseCount; ++phase) {
+        os << (phase == 0 ? "" : ",") << "\"" << phase_name(phase) << "\":{\"wall_ms\":"
+           << to_ms(this->wall_ns[phase]) << ",\"cpu_ms\":" << to_ms(this->cpu_ns[phase]) << "}";
+    }
+    os << "},\"blocks\":" << this->counter(SprayPaintCounter::Blocks)
+       << ",\"stored_blocks\":" << this->counter(SprayPaintCounter::StoredBlocks)
+       << ",\"run_blocks\":" << this->counter(SprayPaintCounter::RunBlocks)
+       << ",\"bytes_in\":" << this->counter(SprayPaintCounter::BytesIn)
+       << ",\"bytes_out\":" << this->counter(SprayPaintCounter::BytesOut)
+       << ",\"symbols\":" << this->counter(SprayPaintCounter::Symbols)
+       << ",\"bits_per_symbol\":" << bits_per_symbol(*this)
+       << ",\"max_code_length\":" << this->max_code_length
+       << "}\n";
+    os.flags(flags);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+
+#include <time.h>
+
+// Built with stats unless the build turns them off (SPRAY_PAINT_STATS=OFF in cmake),
+// in which case every timer and counter below compiles to nothing.
+#ifndef SPRAY_PAINT_STATS
+#define SPRAY_PAINT_STATS 1
+#endif
+
+enum class SprayPaintPhase : uint8_t {
+    // Mapping, reading and writing files and streams.
+    Io,
+    Histogram,
+    // Tree build and code lengths, including package-merge.
+    TreeBuild,
+    // Writing or parsing the code length header.
+    Header,
+    Encode,
+    // Building the decoder's lookup table.
+    DecoderBuild,
+    Decode,
+    // CRC32C of blocks and files, written and verified.
+    Checksum,
+    // The whole job, measured once on the calling thread.
+    Total,
+};
+
+constexpr size_t kSprayPaintPhaseCount = static_cast<size_t>(SprayPaintPhase::Total) + 1;
+
+enum class SprayPaintCounter : uint8_t {
+    Blocks,
+    BytesIn,
+    BytesOut,
+    // Symbols coded and the bits their codes took up, for bits per symbol.
+    Symbols,
+    Bits,
+    // Blocks kept as raw bytes because coding would not shrink them, out of Blocks.
+    StoredBlocks,
+    // Blocks written as runs of repeated bytes, out of Blocks.
+    RunBlocks,
+};
+
+constexpr size_t kSprayPaintCounterCount = static_cast<size_t>(SprayPaintCounter::RunBlocks) + 1;
+
+/* SprayPaintStats collects per phase timings and counters from every thread
+ * working on a job. Everything is a relaxed atomic so workers can record
+ * without taking a lock. Phase times are summed over all threads, so with
+ * several workers a phase can add up to more than the total wall time.*/
+struct SprayPaintStats {
+    std::array<std::atomic<uint64_t>, kSprayPaintPhaseCount> wall_ns{};
+
+    std::array<std::atomic<uint64_t>, kSprayPaintPhaseCount> cpu_ns{};
+
+    std::array<std::atomic<uint64_t>, kSprayPaintCounterCount> counters{};
+
+    // Deepest code (tree depth) seen in any block.
+    std::atomic<uint64_t> max_code_length{0};
+
+    [[nodiscard]] uint64_t counter(SprayPaintCounter c) const {
+        return this->counters[static_cast<size_t>(c)].load(std::memory_order_relaxed);
+    }
+
+    // Human readable table.
+    void print(std::ostream& os) const;
+
+    // The same numbers as a single JSON object.
+    void print_json(std::ostream& os) const;
+};
+
+#if SPRAY_PAINT_STATS
+
+inline void record(SprayPaintStats* stats, SprayPaintCounter c, uint64_t n) {
+    if (stats != nullptr) {
+        stats->counters[static_cast<size_t>(c)].fetch_add(n, std::memory_order_relaxed);
+    }
+}
+
+inline void record_code_length(SprayPaintStats* stats, uint64_t length) {
+    if (stats == nullptr) {
+        return;
+    }
+    auto current = stats->max_code_length.load(std::memory_order_relaxed);
+    while (length > current && !stats->max_code_length.compare_exchange_weak(current, length, std::memory_order_relaxed)) {
+    }
+}
+
+/* Adds the wall and CPU time between construction and destruction to a phase.
+ * CPU time is the calling thread's, except for Total which takes the whole
+ * process's so it covers the workers too. A null stats pointer skips the clock
+ * reads entirely.*/
+class SprayPaintTimer {
+public:
+    SprayPaintTimer(SprayPaintStats* stats, SprayPaintPhase phase) : stats_(stats), phase_(phase) {
+        if (this->stats_ != nullptr) {
+            this->wall_ = now(CLOCK_MONOTONIC);
+            this->cpu_ = now(this->cpu_clock());
+        }
+    }
+
+    SprayPaintTimer(const SprayPaintTimer&) = delete;
+    SprayPaintTimer& operator=(const SprayPaintTimer&) = delete;
+
+    ~SprayPaintTimer() {
+        if (this->stats_ != nullptr) {
+            auto idx = static_cast<size_t>(this->phase_);
+            this->stats_->wall_ns[idx].fetch_add(now(CLOCK_MONOTONIC) - this->wall_, std::memory_order_relaxed);
+            this->stats_->cpu_ns[idx].fetch_add(now(this->cpu_clock()) - this->cpu_, std::memory_order_relaxed);
+        }
+    }
+private:
+    static uint64_t now(clockid_t clock) {
+        timespec ts{};
+        ::clock_gettime(clock, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+    }
+
+    [[nodiscard]] clockid_t cpu_clock() const {
+        return this->phase_ == SprayPaintPhase::Total ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID;
+    }
+
+    SprayPaintStats* stats_;
+
+    SprayPaintPhase phase_;
+
+    uint64_t wall_ = 0;
+
+    uint64_t cpu_ = 0;
+};
+
+#else
+
+inline void record(SprayPaintStats*, SprayPaintCounter, uint64_t) {}
+
+inline void record_code_length(SprayPaintStats*, uint64_t) {}
+
+class SprayPaintTimer {
+public:
+    SprayPaintTimer(SprayPaintStats*, SprayPaintPhase) {}
+};
+
+#endif
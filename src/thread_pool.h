@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/* Fixed size pool of worker threads pulling tasks off a shared queue. Tasks
+ * are coarse (a whole block each) so a single mutex protected deque is plenty.*/
+class ThreadPool {
+public:
+    // 0 threads means one per hardware thread.
+    explicit ThreadPool(unsigned threads) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            this->workers_.emplace_back([this] { this->worker(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(this->mu_);
+            this->stop_ = true;
+        }
+        this->cv_.notify_all();
+        for (auto& w : this->workers_) {
+            w.join();
+        }
+    }
+
+    // Queues f to run on a worker. Exceptions thrown by f are rethrown from
+    // the returned future's get().
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& f) {
+        std::packaged_task<std::invoke_result_t<F>()> task(std::forward<F>(f));
+        auto future = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(this->mu_);
+            this->tasks_.emplace_back(std::move(task));
+        }
+        this->cv_.notify_one();
+        return future;
+    }
+
+    [[nodiscard]] unsigned size() const {
+        return static_cast<unsigned>(this->workers_.size());
+    }
+private:
+    void worker() {
+        while (true) {
+            std::move_only_function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(this->mu_);
+                this->cv_.wait(lock, [this] { return this->stop_ || !this->tasks_.empty(); });
+                if (this->tasks_.empty()) {
+                    return;
+                }
+                task = std::move(this->tasks_.front());
+                this->tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+
+    std::deque<std::move_only_function<void()>> tasks_;
+
+    std::mutex mu_;
+
+    std::condition_variable cv_;
+
+    bool stop_ = false;
+};
@@ -1,7 +1,50 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <numeric>
+#include <random>
 #include "../src/huffman.h"
+#include "../src/bitstream.h"
+#include "../src/buffer.h"
+#include "../src/checksum.h"
+#include "../src/context.h"
+#include "../src/decoder.h"
+#include "../src/dictionary.h"
+#include "../src/package_merge.h"
 #include "../src/heap/min_heap.h"
+#include "../src/heap/dary_heap.h"
+
+/* Every heap allocation in the test binary goes through these, so tests can
+ * check that code promising not to allocate does not.*/
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC sees free() on memory from operator new once these are inlined, which is
+// exactly the pairing replacing both is meant to set up.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 
 class SprayPaintTest : public ::testing::Test {
 protected:
@@ -63,6 +106,30 @@ TEST_F(SprayPaintTest, TestHuffBuildCharMap) {
     EXPECT_EQ(1, o->second) << "Incorrect count for 'o'";
 }
 
+TEST_F(SprayPaintTest, TestHistogram) {
+    std::vector<uint8_t> data(100003);
+    uint32_t x = 12345;
+    for (auto& b : data) {
+        x = x * 1103515245 + 12345;
+        b = (x >> 16) % 7 == 0 ? 0 : static_cast<uint8_t>(x >> 24);
+    }
+
+    // Every unaligned start and ragged tail matches a naive count
+    for (size_t start : {0, 1, 3, 7}) {
+        for (size_t size : {0, 1, 15, 16, 17, 1000, 99990}) {
+            SprayPaintHistogram expected{};
+            for (size_t i = start; i < start + size; ++i) {
+                ++expected[data[i]];
+            }
+            ASSERT_EQ(histogram(data.data() + start, size), expected) << "start=" << start << " size=" << size;
+        }
+    }
+
+    auto counts = histogram(data.data(), data.size());
+    ASSERT_EQ(distinct_symbols(counts), 256);
+    ASSERT_EQ(std::accumulate(counts.begin(), counts.end(), uint64_t{0}), data.size());
+}
+
 TEST_F(SprayPaintTest, TestHuffNode) {
     auto node1 = LeafNode(10, 'A');
     auto node2 = LeafNode(12, 'B');
@@ -141,6 +208,61 @@ TEST_F(SprayPaintTest, MaxHeapTests) {
     ASSERT_EQ(min_heap.pop(), 2);
 }
 
+template <size_t Arity>
+static void check_dary_heap_order(const std::vector<int>& values) {
+    auto sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+
+    auto heap = DaryMinHeap<int, Arity>();
+    for (auto v : values) {
+        heap.put(v);
+    }
+    for (auto v : sorted) {
+        ASSERT_EQ(heap.pop(), v) << "arity " << Arity;
+    }
+    ASSERT_TRUE(heap.empty());
+
+    auto built = DaryMaxHeap<int, Arity>(values.begin(), values.end());
+    for (auto it = sorted.rbegin(); it != sorted.rend(); ++it) {
+        ASSERT_EQ(built.top(), *it) << "arity " << Arity;
+        ASSERT_EQ(built.pop(), *it) << "arity " << Arity;
+    }
+}
+
+TEST_F(SprayPaintTest, DaryHeapTests) {
+    std::vector<int> values;
+    uint32_t x = 12345;
+    for (int i = 0; i < 1000; ++i) {
+        x = x * 1103515245 + 12345;
+        values.push_back(static_cast<int>(x >> 16) % 100);
+    }
+    check_dary_heap_order<2>(values);
+    check_dary_heap_order<4>(values);
+    check_dary_heap_order<8>(values);
+
+    auto heap = DaryMinHeap<int>();
+    ASSERT_ANY_THROW(heap.pop()) << "should throw when there is no data in the heap";
+
+    // heapify on a non empty heap merges the new elements in
+    heap.put(7);
+    std::vector<int> more = {9, 1, 4};
+    heap.heapify(more.begin(), more.end());
+    ASSERT_EQ(heap.size(), 4);
+    ASSERT_EQ(heap.pop(), 1);
+    ASSERT_EQ(heap.pop(), 4);
+    ASSERT_EQ(heap.pop(), 7);
+
+    // Move only elements with a custom comparator
+    auto by_value = [](const std::unique_ptr<int>& a, const std::unique_ptr<int>& b) { return *a < *b; };
+    auto owned = DaryHeap<std::unique_ptr<int>, 8, decltype(by_value)>(by_value);
+    owned.emplace(std::make_unique<int>(3));
+    owned.put(std::make_unique<int>(1));
+    owned.emplace(new int(2));
+    ASSERT_EQ(*owned.pop(), 1);
+    ASSERT_EQ(*owned.pop(), 2);
+    ASSERT_EQ(*owned.pop(), 3);
+}
+
 TEST_F(SprayPaintTest, TestMinHeapWithNode) {
     auto node1 = LeafNode(5, 'a');
     auto node2 = LeafNode(8, 'b');
@@ -188,11 +310,993 @@ TEST_F(SprayPaintTest, TestSprayPaintTree) {
     ASSERT_EQ(a, b);
 }
 
+TEST_F(SprayPaintTest, TestSprayPaintTreeArena) {
+    // Fibonacci weights give the deepest tree possible, one leaf per level
+    SprayPaintHistogram counts{};
+    uint64_t a = 1, b = 1;
+    for (int sym = 0; sym < 60; ++sym) {
+        counts[sym] = a;
+        a = std::exchange(b, a + b);
+    }
+
+    auto tree = SprayPaintTree();
+    tree.register_charset(counts);
+    tree.build();
+    ASSERT_EQ(tree.node_count(), 2 * distinct_symbols(counts) - 1);
+    ASSERT_EQ(tree.root()->weight(), std::accumulate(counts.begin(), counts.end(), uint64_t{0}));
+
+    auto lengths = tree.code_lengths();
+    ASSERT_NO_THROW(validate_code_lengths(lengths));
+    ASSERT_GE(*std::max_element(lengths.begin(), lengths.end()), 50);
+
+    // Every internal node's weight is the sum of its children's
+    for (size_t i = 0; i < tree.node_count(); ++i) {
+        const auto& node = tree.node(static_cast<uint16_t>(i));
+        if (!node.leaf()) {
+            ASSERT_EQ(node.weight(), tree.node(node.left()).weight() + tree.node(node.right()).weight());
+        }
+    }
+
+    // Copies are independent of the original and rebuilding starts from scratch
+    auto copy = *tree.clone();
+    tree.build();
+    ASSERT_EQ(copy.code_lengths(), tree.code_lengths());
+    ASSERT_EQ(SprayPaintTree::from_code_lengths(lengths).code_lengths(), lengths);
+}
+
+std::string read_file(const std::string& name) {
+    std::ifstream in(name, std::ios::binary);
+    return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintTreeBuildStrategies) {
+    auto cost = [](const SprayPaintHistogram& counts, const SprayPaintCodeLengths& lengths) {
+        uint64_t bits = 0;
+        for (int sym = 0; sym < 256; ++sym) {
+            bits += counts[sym] * lengths[sym];
+        }
+        return bits;
+    };
+
+    std::vector<SprayPaintHistogram> inputs;
+    auto text = read_file("../tests/lm.txt");
+    inputs.push_back(histogram(reinterpret_cast<const uint8_t*>(text.data()), text.size()));
+    SprayPaintHistogram flat{};
+    flat.fill(3);
+    inputs.push_back(flat);
+    SprayPaintHistogram single{};
+    single['x'] = 9;
+    inputs.push_back(single);
+
+    // Ties are broken differently, but both must give an optimal code
+    for (const auto& counts : inputs) {
+        auto heap = SprayPaintTree();
+        heap.register_charset(counts);
+        heap.build(SprayPaintBuildStrategy::Heap);
+        auto two_queue = SprayPaintTree();
+        two_queue.register_charset(counts);
+        two_queue.build(SprayPaintBuildStrategy::TwoQueue);
+
+        ASSERT_NO_THROW(validate_code_lengths(two_queue.code_lengths()));
+        ASSERT_EQ(two_queue.node_count(), heap.node_count());
+        ASSERT_EQ(cost(counts, two_queue.code_lengths()), cost(counts, heap.code_lengths()));
+    }
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintDecoder) {
+    auto tree = SprayPaintTree();
+    tree.register_charset(build_char_map(medium_test_file));
+    tree.build();
+    auto codes = tree.encode();
+
+    std::string input = "Wow! Tadashi and Mizu are really cute cats.";
+    std::vector<uint8_t> packed((input.size() * 64) / 8 + 1, 0);
+    size_t bits = 0;
+    for (auto c : input) {
+        for (auto bit : codes[c]) {
+            packed[bits / 8] |= bit << (7 - (bits % 8));
+            ++bits;
+        }
+    }
+
+    auto decoder = SprayPaintDecoder(tree);
+    auto reader = BitReader(packed.data(), bits);
+    std::vector<uint8_t> out(input.size() + 16);
+    auto n = decoder.decode(reader, out.data(), out.size());
+    ASSERT_EQ(n, input.size());
+    ASSERT_EQ(std::string(out.begin(), out.begin() + n), input);
+    ASSERT_EQ(reader.remaining(), 0);
+
+    // Decoding into a short buffer stops exactly at dst_len and can be resumed
+    auto reader2 = BitReader(packed.data(), bits);
+    auto first = decoder.decode(reader2, out.data(), 5);
+    ASSERT_EQ(first, 5);
+    auto rest = decoder.decode(reader2, out.data() + 5, out.size() - 5);
+    ASSERT_EQ(first + rest, input.size());
+    ASSERT_EQ(std::string(out.begin(), out.begin() + input.size()), input);
+}
+
+TEST_F(SprayPaintTest, TestEncodeTable) {
+    auto tree = SprayPaintTree();
+    tree.register_charset(build_char_map(medium_test_file));
+    tree.build();
+
+    auto table = tree.encode_table();
+    auto codes = tree.encode();
+    for (int sym = 0; sym < 256; ++sym) {
+        auto it = codes.find(static_cast<char>(sym));
+        if (it == codes.end()) {
+            ASSERT_EQ(table[sym].length, 0);
+            continue;
+        }
+
+        ASSERT_EQ(table[sym].length, it->second.size());
+        uint64_t bits = 0;
+        for (auto bit : it->second) {
+            bits = (bits << 1) | bit;
+        }
+        ASSERT_EQ(table[sym].bits, bits);
+    }
+}
+
+TEST_F(SprayPaintTest, TestBitWriter) {
+    std::vector<std::pair<uint64_t, unsigned>> codes = {
+            {0b1, 1}, {0b01, 2}, {0x1FFF, 13}, {0x0, 7}, {0xABCDEF01, 32},
+            {0x1234567890AULL, 44}, {0b101, 3}, {0x7F, 7},
+    };
+
+    std::vector<uint8_t> buffer(64);
+    auto writer = BitWriter(buffer.data(), buffer.size());
+    size_t bits = 0;
+    for (int round = 0; round < 3; ++round) {
+        for (auto [code, len] : codes) {
+            writer.write(code, len);
+            bits += len;
+        }
+    }
+    writer.flush();
+    ASSERT_EQ(writer.bytes(), (bits + 7) / 8);
+
+    auto reader = BitReader(buffer.data(), bits);
+    for (int round = 0; round < 3; ++round) {
+        for (auto [code, len] : codes) {
+            uint64_t got = 0;
+            for (unsigned done = 0; done < len; done += 16) {
+                auto n = std::min(16u, len - done);
+                got = (got << n) | reader.peek(n);
+                reader.consume(n);
+            }
+            ASSERT_EQ(got, code) << "code of length " << len;
+        }
+    }
+    ASSERT_EQ(reader.remaining(), 0);
+}
+
+TEST_F(SprayPaintTest, TestCanonicalCodeLengths) {
+    auto tree = SprayPaintTree();
+    tree.register_charset(build_char_map(large_test_file));
+    tree.build();
+
+    auto lengths = tree.code_lengths();
+    ASSERT_NO_THROW(validate_code_lengths(lengths));
+
+    // Canonical codes are prefix free and sorted by (length, symbol)
+    auto codes = canonical_codes(lengths);
+    for (int a = 0; a < 256; ++a) {
+        for (int b = 0; b < 256; ++b) {
+            if (a == b || lengths[a] == 0 || lengths[b] == 0 || lengths[a] > lengths[b]) {
+                continue;
+            }
+            ASSERT_NE(codes[b].bits >> (lengths[b] - lengths[a]), codes[a].bits) << "code " << a << " is a prefix of " << b;
+        }
+    }
+
+    std::stringstream ss;
+    write_code_lengths(ss, lengths);
+    ASSERT_EQ(ss.str().size(), code_lengths_size(lengths));
+    // 256 nibbles plus an escape nibble for each of the rare codes longer than 14 bits
+    ASSERT_LT(ss.str().size(), 160);
+    ASSERT_EQ(read_code_lengths(ss), lengths);
+
+    // Lengths that oversubscribe the code space are rejected
+    SprayPaintCodeLengths bad{};
+    bad['a'] = 1;
+    bad['b'] = 1;
+    bad['c'] = 1;
+    ASSERT_ANY_THROW(validate_code_lengths(bad));
+    ASSERT_ANY_THROW(SprayPaintDecoder{bad});
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileSingleSymbol) {
+    {
+        std::ofstream out("single.txt", std::ios::binary);
+        out << std::string(1000, 'z');
+    }
+
+    SprayPaintFile("single.spz", "single.txt").write();
+    SprayPaintFile("single_out.txt", "single.spz").read();
+
+    ASSERT_EQ(read_file("single.txt"), read_file("single_out.txt"));
+}
+
 TEST_F(SprayPaintTest, TestScratch) {
-    SprayPaintTree tree1;
-    SprayPaintTree tree2;
-    auto spf = SprayPaintFile(std::move(tree1), "t3", "/Users/devan/Documents/Projects/spray-paint/tests/lm.txt");
-    auto spf2 = SprayPaintFile(std::move(tree2), "/Users/devan/Documents/Projects/spray-paint/tests/tt2.txt", "t3");
+    auto spf = SprayPaintFile("t3", "../tests/lm.txt");
+    auto spf2 = SprayPaintFile("tt2.txt", "t3");
     spf.write();
     spf2.read();
-}
\ No newline at end of file
+
+    ASSERT_EQ(read_file("../tests/lm.txt"), read_file("tt2.txt"));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileBlocks) {
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    options.threads = 4;
+    SprayPaintFile("blocks.spz", "../tests/lm.txt", options).write();
+    SprayPaintFile("blocks.txt", "blocks.spz").read();
+    ASSERT_EQ(read_file("../tests/lm.txt"), read_file("blocks.txt"));
+
+    // The footer points at an index with one entry per block
+    auto spz = read_file("blocks.spz");
+    ASSERT_GE(spz.size(), kFooterSize);
+    const auto* footer = reinterpret_cast<const uint8_t*>(spz.data()) + spz.size() - kFooterSize;
+    ASSERT_EQ(std::memcmp(footer + kFooterChecksumOffset + 4, kSprayPaintFooterMagic, sizeof(kSprayPaintFooterMagic)), 0);
+    auto lm_size = read_file("../tests/lm.txt").size();
+    ASSERT_EQ(load_le64(footer + 8), (lm_size + options.block_size - 1) / options.block_size);
+    ASSERT_EQ(load_le64(footer + 16), lm_size);
+    ASSERT_EQ(load_le64(footer), spz.size() - kFooterSize - load_le64(footer + 8) * kIndexEntrySize);
+
+    auto index = read_block_index(reinterpret_cast<const uint8_t*>(spz.data()), spz.size());
+    ASSERT_EQ(index.size(), load_le64(footer + 8));
+    for (size_t i = 0; i < index.size(); ++i) {
+        ASSERT_EQ(index[i].raw_offset, i * options.block_size);
+    }
+
+    // A damaged index is caught before any block is decoded
+    spz[spz.size() - kFooterSize - kIndexEntrySize] ^= 1;
+    {
+        std::ofstream out("blocks_bad.spz", std::ios::binary);
+        out << spz;
+    }
+    ASSERT_ANY_THROW(SprayPaintFile("blocks_bad.txt", "blocks_bad.spz").read());
+}
+
+TEST_F(SprayPaintTest, TestPackageMerge) {
+    auto cost = [](const SprayPaintHistogram& counts, const SprayPaintCodeLengths& lengths) {
+        uint64_t bits = 0;
+        for (int sym = 0; sym < 256; ++sym) {
+            bits += counts[sym] * lengths[sym];
+        }
+        return bits;
+    };
+
+    // Fibonacci counts make the unlimited tree one level deeper per symbol
+    SprayPaintHistogram counts{};
+    uint64_t a = 1, b = 1;
+    for (int sym = 0; sym < 40; ++sym) {
+        counts[sym * 3] = a;
+        a = std::exchange(b, a + b);
+    }
+    auto tree = SprayPaintTree();
+    tree.register_charset(counts);
+    tree.build();
+    auto huffman = tree.code_lengths();
+    ASSERT_EQ(longest_code(huffman), 39);
+
+    uint64_t previous = std::numeric_limits<uint64_t>::max();
+    for (unsigned cap = kMinCodeLengthLimit; cap <= kMaxCodeLength; ++cap) {
+        auto lengths = package_merge(counts, cap);
+        ASSERT_LE(longest_code(lengths), cap);
+        ASSERT_NO_THROW(validate_code_lengths(lengths));
+
+        // Every symbol keeps a code, the code stays complete and a looser cap never costs more
+        uint64_t kraft = 0;
+        for (int sym = 0; sym < 256; ++sym) {
+            ASSERT_EQ(lengths[sym] != 0, counts[sym] != 0);
+            kraft += lengths[sym] ? uint64_t{1} << (kMaxCodeLength - lengths[sym]) : 0;
+        }
+        ASSERT_EQ(kraft, uint64_t{1} << kMaxCodeLength);
+        ASSERT_LE(cost(counts, lengths), previous);
+        previous = cost(counts, lengths);
+    }
+    ASSERT_EQ(previous, cost(counts, huffman));
+
+    SprayPaintHistogram single{};
+    single[7] = 100;
+    ASSERT_EQ(package_merge(single, 8)[7], 1);
+    ASSERT_ANY_THROW(package_merge(counts, 7));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileMaxCodeLength) {
+    // Skewed input whose unlimited code goes well past 9 bits
+    std::string input;
+    uint64_t a = 1, b = 1;
+    for (int sym = 0; sym < 24; ++sym) {
+        input.append(a, static_cast<char>('a' + sym));
+        a = std::exchange(b, a + b);
+    }
+    // Mixed up, as sorted it is 24 runs and would be a Run block
+    std::shuffle(input.begin(), input.end(), std::mt19937(5));
+    {
+        std::ofstream out("skewed.txt", std::ios::binary);
+        out << input;
+    }
+
+    SprayPaintOptions options;
+    options.max_code_length = 9;
+    SprayPaintFile("skewed.spz", "skewed.txt", options).write();
+    SprayPaintFile("skewed_out.txt", "skewed.spz").read();
+    ASSERT_EQ(read_file("skewed_out.txt"), input);
+
+    auto spz = read_file("skewed.spz");
+    const auto* data = reinterpret_cast<const uint8_t*>(spz.data());
+    ASSERT_EQ(read_file_header(data, spz.size()).max_code_length, 9);
+    SprayPaintCodeLengths lengths{};
+    read_code_lengths(data + kSprayPaintFileHeaderSize + kBlockHeaderSize, spz.size(), lengths);
+    ASSERT_LE(longest_code(lengths), 9);
+
+    // A block using longer codes than its file header allows is rejected
+    auto header = read_block_header(data + kSprayPaintFileHeaderSize);
+    std::vector<uint8_t> out(header.raw_size);
+    ASSERT_ANY_THROW(decompress_block(header, data + kSprayPaintFileHeaderSize + kBlockHeaderSize, out.data(), 8));
+
+    options.max_code_length = 7;
+    ASSERT_ANY_THROW(SprayPaintFile("skewed.spz", "skewed.txt", options).write());
+}
+
+TEST_F(SprayPaintTest, TestAdaptiveBlock) {
+    std::mt19937 rng(7);
+    std::string random(50000, '\0');
+    for (auto& c : random) {
+        c = static_cast<char>(rng());
+    }
+    std::string all_bytes;
+    for (int rep = 0; rep < 3; ++rep) {
+        for (int sym = 0; sym < 256; ++sym) {
+            all_bytes.push_back(static_cast<char>(sym));
+        }
+    }
+
+    auto text = read_file("../tests/lm.txt");
+    for (const auto& input : {std::string("a"), std::string(7, 'z'), std::string("abababababcab"), all_bytes, random, text}) {
+        const auto* src = reinterpret_cast<const uint8_t*>(input.data());
+        auto block = compress_adaptive_block(src, input.size());
+        auto header = read_block_header(block.data());
+        // Input the codes would not shrink is stored instead
+        ASSERT_EQ(header.type, header.payload_size < input.size() ? SprayPaintBlockType::Adaptive
+                                                                  : SprayPaintBlockType::Stored);
+        ASSERT_EQ(header.raw_size, input.size());
+        ASSERT_EQ(kBlockHeaderSize + header.payload_size, block.size());
+        ASSERT_LE(header.payload_size, max_block_payload_size(input.size()));
+
+        std::string out(input.size(), '\0');
+        decompress_block(header, block.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data()));
+        ASSERT_EQ(out, input);
+    }
+
+    // Close to the two pass code on text, without storing any code lengths
+    const auto* src = reinterpret_cast<const uint8_t*>(text.data());
+    auto adaptive = compress_adaptive_block(src, text.size());
+    auto canonical = compress_block(src, text.size());
+    ASSERT_EQ(read_block_header(adaptive.data()).type, SprayPaintBlockType::Adaptive);
+    ASSERT_LT(adaptive.size(), canonical.size() + canonical.size() / 50);
+
+    auto header = read_block_header(adaptive.data());
+    header.payload_size /= 2;
+    std::vector<uint8_t> out(header.raw_size);
+    ASSERT_ANY_THROW(decompress_block(header, adaptive.data() + kBlockHeaderSize, out.data()));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileAdaptive) {
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    options.codec = SprayPaintCodec::Adaptive;
+    SprayPaintFile("adaptive.spz", "../tests/lm.txt", options).write();
+    auto original = read_file("../tests/lm.txt");
+
+    // Readers need no options, the block type says how each block is coded
+    SprayPaintFile("adaptive.txt", "adaptive.spz").read();
+    ASSERT_EQ(read_file("adaptive.txt"), original);
+    SprayPaintFile("adaptive.txt", "adaptive.spz").read_range(65530, 70000);
+    ASSERT_EQ(read_file("adaptive.txt"), original.substr(65530, 70000));
+
+    std::ifstream in("../tests/lm.txt", std::ios::binary);
+    std::stringstream compressed;
+    SprayPaintStream(options).write(in, compressed);
+    ASSERT_EQ(compressed.str(), read_file("adaptive.spz"));
+
+    std::stringstream decompressed;
+    SprayPaintStream().read(compressed, decompressed);
+    ASSERT_EQ(decompressed.str(), original);
+}
+
+TEST_F(SprayPaintTest, TestContextClusters) {
+    // Two kinds of context with nothing in common end up in different clusters
+    std::string input;
+    for (int i = 0; i < 20000; ++i) {
+        input += (i % 3 == 0) ? "a1" : "b2";
+        input += static_cast<char>('c' + i % 7);
+    }
+    auto counts = std::make_unique<SprayPaintContextCounts>();
+    context_histogram(reinterpret_cast<const uint8_t*>(input.data()), input.size(), *counts);
+    ASSERT_EQ((*counts)[0]['a'], 1);
+    ASSERT_EQ((*counts)['a']['1'], (*counts)['a']['1'] + (*counts)['a']['2']);
+
+    auto clusters = cluster_contexts(*counts);
+    ASSERT_GE(clusters.histograms.size(), 2);
+    ASSERT_LE(clusters.histograms.size(), kMaxContextClusters);
+    ASSERT_NE(clusters.map['a'], clusters.map['1']);
+    uint64_t total = 0;
+    for (const auto& h : clusters.histograms) {
+        total += std::accumulate(h.begin(), h.end(), uint64_t{0});
+    }
+    ASSERT_EQ(total, input.size());
+
+    ASSERT_EQ(cluster_contexts(*counts, 1).histograms.size(), 1);
+}
+
+TEST_F(SprayPaintTest, TestContextBlock) {
+    auto text = read_file("../tests/lm.txt");
+    const auto* src = reinterpret_cast<const uint8_t*>(text.data());
+    auto block = compress_context_block(src, text.size());
+    auto header = read_block_header(block.data());
+    ASSERT_EQ(header.type, SprayPaintBlockType::Context);
+    ASSERT_LT(block.size(), compress_block(src, text.size()).size());
+
+    std::string out(text.size(), '\0');
+    decompress_block(header, block.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data()));
+    ASSERT_EQ(out, text);
+
+    // Text the extra tables do not pay off on falls back to a plain block,
+    // and random bytes, which no code shrinks, to a stored one
+    auto plain = compress_context_block(src, 300);
+    ASSERT_EQ(read_block_header(plain.data()).type, SprayPaintBlockType::Huffman);
+    std::mt19937 rng(11);
+    std::string random(20000, '\0');
+    for (auto& c : random) {
+        c = static_cast<char>(rng());
+    }
+    auto fallback = compress_context_block(reinterpret_cast<const uint8_t*>(random.data()), random.size());
+    ASSERT_EQ(read_block_header(fallback.data()).type, SprayPaintBlockType::Stored);
+
+    // Corrupt cluster count and truncated data are rejected
+    auto corrupt = block;
+    corrupt[kBlockHeaderSize] = kMaxContextClusters + 1;
+    ASSERT_ANY_THROW(decompress_block(header, corrupt.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data())));
+    auto truncated = header;
+    truncated.payload_size /= 2;
+    ASSERT_ANY_THROW(decompress_block(truncated, block.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data())));
+}
+
+/* Compresses input in 50000 byte blocks with every codec and checks that
+ * exactly the blocks starting in [begin, end) come out as `type` (and are
+ * counted under `counter`), then that the file and a range across `end`
+ * decompress back to the input.*/
+static void check_block_types(const std::string& input, SprayPaintBlockType type, uint64_t begin, uint64_t end,
+                              SprayPaintCounter counter) {
+    auto in = std::as_bytes(std::span(input.data(), input.size()));
+    for (auto codec : {SprayPaintCodec::Static, SprayPaintCodec::Adaptive, SprayPaintCodec::Context,
+                       SprayPaintCodec::Interleaved}) {
+        SprayPaintStats stats;
+        SprayPaintOptions options;
+        options.block_size = 50000;
+        options.codec = codec;
+        options.stats = &stats;
+        std::vector<std::byte> compressed(compress_bound(input.size(), options));
+        compressed.resize(compress(in, compressed, options));
+
+        uint64_t matching = 0;
+        for (const auto& entry : read_block_index(reinterpret_cast<const uint8_t*>(compressed.data()), compressed.size())) {
+            auto header = read_block_header(reinterpret_cast<const uint8_t*>(compressed.data()) + entry.offset);
+            ASSERT_EQ(header.type == type, entry.raw_offset >= begin && entry.raw_offset < end);
+            matching += header.type == type;
+        }
+        ASSERT_EQ(matching, (end - begin + options.block_size - 1) / options.block_size);
+#if SPRAY_PAINT_STATS
+        ASSERT_EQ(stats.counter(counter), matching);
+#else
+        (void)counter;
+#endif
+
+        std::vector<std::byte> out(input.size());
+        decompress(compressed, out, options);
+        ASSERT_TRUE(std::equal(out.begin(), out.end(), in.begin()));
+        std::string slice(10000, '\0');
+        decompress_range(compressed, end - 5000, std::as_writable_bytes(std::span(slice.data(), slice.size())), options);
+        ASSERT_EQ(slice, input.substr(end - 5000, 10000));
+    }
+}
+
+TEST_F(SprayPaintTest, TestStoredBlock) {
+    // Text with a run of random bytes (think a jpeg in a tarball) in the middle
+    auto text = read_file("../tests/lm.txt");
+    std::mt19937 rng(13);
+    std::string random(200000, '\0');
+    for (auto& c : random) {
+        c = static_cast<char>(rng());
+    }
+    auto input = text.substr(0, 100000) + random + text.substr(0, 100000);
+
+    ASSERT_NO_FATAL_FAILURE(check_block_types(input, SprayPaintBlockType::Stored, 100000, 300000,
+                                              SprayPaintCounter::StoredBlocks));
+
+    // No block grows, so the whole file stays within its framing of the input
+    SprayPaintOptions options;
+    options.block_size = 50000;
+    ASSERT_EQ(compress_bound(input.size(), options), kSprayPaintFileHeaderSize + kBlockHeaderSize + kFooterSize
+                                                     + 8 * (kBlockHeaderSize + kIndexEntrySize) + input.size());
+
+    // A stored block's payload is exactly its raw bytes
+    const auto* src = reinterpret_cast<const uint8_t*>(random.data());
+    auto block = compress_block(src, 1000);
+    auto header = read_block_header(block.data());
+    ASSERT_EQ(header.type, SprayPaintBlockType::Stored);
+    ASSERT_EQ(block.size(), kBlockHeaderSize + 1000);
+    ASSERT_EQ(std::memcmp(block.data() + kBlockHeaderSize, src, 1000), 0);
+    header.payload_size -= 1;
+    std::string out(1000, '\0');
+    ASSERT_ANY_THROW(decompress_block(header, block.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data())));
+}
+
+TEST_F(SprayPaintTest, TestRunBlock) {
+    // A block of one byte is a handful of bytes, whatever the codec
+    std::string zeros(1 << 20, '\0');
+    const auto* src = reinterpret_cast<const uint8_t*>(zeros.data());
+    auto block = compress_block(src, zeros.size());
+    auto header = read_block_header(block.data());
+    ASSERT_EQ(header.type, SprayPaintBlockType::Run);
+    ASSERT_EQ(block.size(), kBlockHeaderSize + 4);
+    std::string out(zeros.size(), 'x');
+    decompress_block(header, block.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data()));
+    ASSERT_EQ(out, zeros);
+
+    // Headers carry the checksum of 100 'a's, so the only thing wrong with
+    // each payload is its runs: one that never ends, one that runs past the
+    // raw size and one that stops short of it
+    std::string as(100, 'a');
+    auto checksum = crc32c(reinterpret_cast<const uint8_t*>(as.data()), as.size());
+    auto run_block_error = [&](std::vector<uint8_t> payload) -> std::string {
+        try {
+            decompress_block({SprayPaintBlockType::Run, 100, static_cast<uint32_t>(payload.size()), checksum},
+                             payload.data(), reinterpret_cast<uint8_t*>(out.data()));
+        } catch (const std::runtime_error& e) {
+            return e.what();
+        }
+        return "";
+    };
+    ASSERT_EQ(run_block_error({'a', 99}), "");
+    ASSERT_EQ(out.substr(0, 100), as);
+    ASSERT_EQ(run_block_error({'a', 0x80, 0x80}), "Run block has a truncated or oversized run length.");
+    ASSERT_EQ(run_block_error({'a', 0x80, 0x80, 0x80, 0x80, 0x80, 0x01}), "Run block has a truncated or oversized run length.");
+    ASSERT_EQ(run_block_error({'a', 100}), "Run block decodes to more bytes than its raw size.");
+    ASSERT_EQ(run_block_error({'a', 49, 'a', 49, 'a', 0}), "Run block decodes to more bytes than its raw size.");
+    ASSERT_EQ(run_block_error({'a', 98}),
+              "Compressed data ended before the expected number of bytes were decoded.");
+
+    // Zeroed records with a few fields set (think a sparse table) in front of
+    // text, which never has the runs to pay
+    std::string input(200000, '\0');
+    for (size_t i = 0; i < input.size(); i += 4096) {
+        input[i] = static_cast<char>(i / 4096 + 1);
+    }
+    input += read_file("../tests/lm.txt").substr(0, 200000);
+    ASSERT_NO_FATAL_FAILURE(check_block_types(input, SprayPaintBlockType::Run, 0, 200000, SprayPaintCounter::RunBlocks));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileContext) {
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    options.max_code_length = 11;
+    options.codec = SprayPaintCodec::Context;
+    SprayPaintFile("context.spz", "../tests/lm.txt", options).write();
+    auto original = read_file("../tests/lm.txt");
+
+    SprayPaintFile("context.txt", "context.spz").read();
+    ASSERT_EQ(read_file("context.txt"), original);
+    SprayPaintFile("context.txt", "context.spz").read_range(100000, 70000);
+    ASSERT_EQ(read_file("context.txt"), original.substr(100000, 70000));
+
+    options.codec = SprayPaintCodec::Static;
+    SprayPaintFile("static.spz", "../tests/lm.txt", options).write();
+    ASSERT_LT(read_file("context.spz").size(), read_file("static.spz").size());
+}
+
+TEST_F(SprayPaintTest, TestInterleavedBlock) {
+    auto text = read_file("../tests/lm.txt");
+
+    // Sizes that leave some streams empty or one byte longer than the others
+    for (size_t size : {size_t{1}, size_t{2}, size_t{3}, size_t{5}, size_t{4099}, text.size()}) {
+        const auto* src = reinterpret_cast<const uint8_t*>(text.data());
+        auto block = compress_interleaved_block(src, size);
+        auto header = read_block_header(block.data());
+        ASSERT_EQ(header.type, header.payload_size < size ? SprayPaintBlockType::Interleaved
+                                                          : SprayPaintBlockType::Stored);
+        ASSERT_EQ(kBlockHeaderSize + header.payload_size, block.size());
+
+        std::string out(size, '\0');
+        decompress_block(header, block.data() + kBlockHeaderSize, reinterpret_cast<uint8_t*>(out.data()));
+        ASSERT_EQ(out, text.substr(0, size)) << "size=" << size;
+    }
+
+    // Same codes as a single stream block, plus the jump table and up to 3 bytes of padding
+    const auto* src = reinterpret_cast<const uint8_t*>(text.data());
+    auto block = compress_interleaved_block(src, text.size());
+    ASSERT_LE(block.size(), compress_block(src, text.size()).size() + 4 * (kInterleavedStreams - 1) + 3);
+
+    // A jump table pointing past the payload is rejected
+    auto header = read_block_header(block.data());
+    SprayPaintCodeLengths lengths{};
+    auto lengths_size = read_code_lengths(block.data() + kBlockHeaderSize, header.payload_size, lengths);
+    store_le32(block.data() + kBlockHeaderSize + lengths_size, header.payload_size);
+    std::vector<uint8_t> out(text.size());
+    ASSERT_ANY_THROW(decompress_block(header, block.data() + kBlockHeaderSize, out.data()));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileInterleaved) {
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    options.codec = SprayPaintCodec::Interleaved;
+    SprayPaintFile("interleaved.spz", "../tests/lm.txt", options).write();
+    auto original = read_file("../tests/lm.txt");
+
+    SprayPaintFile("interleaved.txt", "interleaved.spz").read();
+    ASSERT_EQ(read_file("interleaved.txt"), original);
+    SprayPaintFile("interleaved.txt", "interleaved.spz").read_range(65530, 70000);
+    ASSERT_EQ(read_file("interleaved.txt"), original.substr(65530, 70000));
+}
+
+TEST_F(SprayPaintTest, TestCrc32c) {
+    // Standard check value for CRC32C
+    std::string check = "123456789";
+    ASSERT_EQ(crc32c(reinterpret_cast<const uint8_t*>(check.data()), check.size()), 0xE3069283);
+    ASSERT_EQ(crc32c(nullptr, 0), 0);
+
+    // Chained pieces match one pass, at every split and alignment
+    auto text = read_file("../tests/lm.txt").substr(0, 1000);
+    const auto* data = reinterpret_cast<const uint8_t*>(text.data());
+    auto whole = crc32c(data, text.size());
+    for (size_t split = 0; split < 20; ++split) {
+        ASSERT_EQ(crc32c(data + split, text.size() - split, crc32c(data, split)), whole);
+    }
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileChecksums) {
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    SprayPaintFile("checked.spz", "../tests/lm.txt", options).write();
+    SprayPaintFile("", "checked.spz").verify();
+    std::ifstream good("checked.spz", std::ios::binary);
+    SprayPaintStream().verify(good);
+
+    auto spz = read_file("checked.spz");
+    auto index = read_block_index(reinterpret_cast<const uint8_t*>(spz.data()), spz.size());
+    auto corrupt = [&](size_t pos, const std::string& path) {
+        auto bad = spz;
+        bad[pos] ^= 0x40;
+        std::ofstream out(path, std::ios::binary);
+        out << bad;
+    };
+
+    // A flipped bit in the second block's data: every full read fails, range
+    // reads that skip the block still work
+    corrupt(index[1].offset + index[1].stored_size - 10, "bad_block.spz");
+    ASSERT_ANY_THROW(SprayPaintFile("", "bad_block.spz").verify());
+    ASSERT_ANY_THROW(SprayPaintFile("bad_block.txt", "bad_block.spz").read());
+    ASSERT_ANY_THROW(SprayPaintFile("bad_block.txt", "bad_block.spz").read_range(index[1].raw_offset, 10));
+    SprayPaintFile("bad_block.txt", "bad_block.spz").read_range(0, 1000);
+    ASSERT_EQ(read_file("bad_block.txt"), read_file("../tests/lm.txt").substr(0, 1000));
+    std::ifstream bad_stream("bad_block.spz", std::ios::binary);
+    ASSERT_ANY_THROW(SprayPaintStream().verify(bad_stream));
+
+    // A flipped bit in a block header's checksum only trips the checksums
+    corrupt(index[0].offset + kBlockHeaderSize - 1, "bad_header.spz");
+    ASSERT_ANY_THROW(SprayPaintFile("", "bad_header.spz").verify());
+
+    // The file checksum covers bytes no block checksum does, like the flags
+    corrupt(sizeof(kSprayPaintMagic) + 2, "bad_flags.spz");
+    ASSERT_ANY_THROW(SprayPaintFile("", "bad_flags.spz").verify());
+    ASSERT_ANY_THROW(SprayPaintFile("bad_flags.txt", "bad_flags.spz").read());
+    std::ifstream bad_flags("bad_flags.spz", std::ios::binary);
+    ASSERT_ANY_THROW(SprayPaintStream().verify(bad_flags));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintStats) {
+#if SPRAY_PAINT_STATS
+    SprayPaintStats stats;
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    options.stats = &stats;
+    SprayPaintFile("stats.spz", "../tests/lm.txt", options).write();
+
+    auto lm_size = read_file("../tests/lm.txt").size();
+    auto spz_size = read_file("stats.spz").size();
+    auto blocks = (lm_size + options.block_size - 1) / options.block_size;
+    ASSERT_EQ(stats.counter(SprayPaintCounter::Blocks), blocks);
+    ASSERT_EQ(stats.counter(SprayPaintCounter::BytesIn), lm_size);
+    ASSERT_EQ(stats.counter(SprayPaintCounter::Symbols), lm_size);
+    // Everything but the file header, end block, index and footer is block data
+    ASSERT_EQ(stats.counter(SprayPaintCounter::BytesOut),
+              spz_size - kSprayPaintFileHeaderSize - kBlockHeaderSize - blocks * kIndexEntrySize - kFooterSize);
+    ASSERT_GT(stats.max_code_length, 0);
+    ASSERT_LE(stats.max_code_length, options.max_code_length);
+    ASSERT_GT(stats.cpu_ns[static_cast<size_t>(SprayPaintPhase::Encode)], 0);
+
+    SprayPaintStats read_stats;
+    options.stats = &read_stats;
+    SprayPaintFile("stats.txt", "stats.spz", options).read();
+    ASSERT_EQ(read_stats.counter(SprayPaintCounter::Blocks), blocks);
+    ASSERT_EQ(read_stats.counter(SprayPaintCounter::BytesOut), lm_size);
+    // The reader sees every coded bit plus at most 7 bits of padding per block
+    ASSERT_GE(read_stats.counter(SprayPaintCounter::Bits), stats.counter(SprayPaintCounter::Bits));
+    ASSERT_LT(read_stats.counter(SprayPaintCounter::Bits), stats.counter(SprayPaintCounter::Bits) + 8 * blocks);
+
+    std::stringstream json;
+    stats.print_json(json);
+    ASSERT_NE(json.str().find("\"blocks\":" + std::to_string(blocks)), std::string::npos);
+    ASSERT_NE(json.str().find("\"histogram\":{\"wall_ms\":"), std::string::npos);
+#else
+    GTEST_SKIP() << "built without stats";
+#endif
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileReadRange) {
+    SprayPaintOptions options;
+    options.block_size = 64 * 1024;
+    SprayPaintFile("range.spz", "../tests/lm.txt", options).write();
+    auto original = read_file("../tests/lm.txt");
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+            {0, 10},                      // inside the first block
+            {65530, 20},                  // straddles a block boundary
+            {65536, 65536},               // exactly one block
+            {100000, 300000},             // several whole blocks plus partial edges
+            {original.size() - 5, 100},   // clamped to the end of the data
+            {original.size(), 10},        // empty range at the very end
+    };
+    for (auto [offset, length] : ranges) {
+        SprayPaintFile("range.txt", "range.spz").read_range(offset, length);
+        ASSERT_EQ(read_file("range.txt"), original.substr(offset, length)) << "offset=" << offset << " length=" << length;
+    }
+
+    ASSERT_ANY_THROW(SprayPaintFile("range.txt", "range.spz").read_range(original.size() + 1, 1));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintStream) {
+    SprayPaintOptions options;
+    options.block_size = 100000;
+    options.threads = 2;
+
+    std::ifstream in("../tests/lm.txt", std::ios::binary);
+    std::stringstream compressed;
+    SprayPaintStream(options).write(in, compressed);
+
+    // Streamed output is a regular .spz file
+    SprayPaintFile("stream.spz", "../tests/lm.txt", options).write();
+    ASSERT_EQ(compressed.str(), read_file("stream.spz"));
+
+    std::stringstream decompressed;
+    SprayPaintStream(options).read(compressed, decompressed);
+    ASSERT_EQ(decompressed.str(), read_file("../tests/lm.txt"));
+
+    std::stringstream truncated(compressed.str().substr(0, 5000));
+    std::stringstream sink;
+    ASSERT_ANY_THROW(SprayPaintStream().read(truncated, sink));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintBuffer) {
+    auto text = read_file("../tests/lm.txt");
+    auto in = std::as_bytes(std::span(text.data(), text.size()));
+
+    for (auto codec : {SprayPaintCodec::Static, SprayPaintCodec::Adaptive, SprayPaintCodec::Context,
+                       SprayPaintCodec::Interleaved}) {
+        for (unsigned threads : {1u, 3u}) {
+            SprayPaintOptions options;
+            options.block_size = 100000;
+            options.threads = threads;
+            options.codec = codec;
+
+            std::vector<std::byte> compressed(compress_bound(text.size(), options));
+            compressed.resize(compress(in, compressed, options));
+
+            // Same bytes as the file API, whichever way the blocks were scheduled
+            SprayPaintFile("buffer.spz", "../tests/lm.txt", options).write();
+            auto file = read_file("buffer.spz");
+            ASSERT_EQ(compressed.size(), file.size());
+            ASSERT_EQ(std::memcmp(compressed.data(), file.data(), file.size()), 0);
+
+            ASSERT_EQ(decompressed_size(compressed), text.size());
+            std::string out(text.size(), '\0');
+            ASSERT_EQ(decompress(compressed, std::as_writable_bytes(std::span(out.data(), out.size())), options), text.size());
+            ASSERT_EQ(out, text);
+            verify_compressed(compressed, options);
+
+            std::string slice(1000, '\0');
+            decompress_range(compressed, 99500, std::as_writable_bytes(std::span(slice.data(), slice.size())), options);
+            ASSERT_EQ(slice, text.substr(99500, 1000));
+        }
+    }
+
+    // Buffers that are too small are refused rather than overrun
+    std::vector<std::byte> small(compress_bound(text.size()) - 1);
+    ASSERT_ANY_THROW(compress(in, small));
+    std::vector<std::byte> compressed(compress_bound(text.size()));
+    compressed.resize(compress(in, compressed));
+    std::vector<std::byte> out(text.size() - 1);
+    ASSERT_ANY_THROW(decompress(compressed, out));
+    ASSERT_ANY_THROW(decompress_range(compressed, 1, std::span(out.data(), text.size())));
+
+    // Corrupt block sizes are caught before anything is decoded out of bounds
+    auto bad = compressed;
+    store_le32(reinterpret_cast<uint8_t*>(bad.data()) + kSprayPaintFileHeaderSize + 5, 0xFFFFFF);
+    out.resize(text.size());
+    ASSERT_ANY_THROW(decompress(bad, out));
+    ASSERT_ANY_THROW(verify_compressed(bad));
+
+    // Empty input is still a complete file
+    std::vector<std::byte> empty(compress_bound(0));
+    empty.resize(compress({}, empty));
+    ASSERT_EQ(decompressed_size(empty), 0);
+    ASSERT_EQ(decompress(empty, {}), 0);
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintContexts) {
+    auto text = read_file("../tests/lm.txt");
+
+    for (auto codec : {SprayPaintCodec::Static, SprayPaintCodec::Adaptive, SprayPaintCodec::Context,
+                       SprayPaintCodec::Interleaved}) {
+        SprayPaintOptions options;
+        options.threads = 1;
+        options.block_size = 4096;
+        options.codec = codec;
+        SprayPaintCompressor compressor(options);
+        SprayPaintDecompressor decompressor(options);
+
+        // Messages of every size class, some spanning blocks, one context each
+        // way for all of them
+        size_t pos = 0;
+        for (size_t size : {1, 100, 1024, 4096, 5000, 16384, 37, 8192}) {
+            auto in = std::as_bytes(std::span(text.data() + pos, size));
+            pos += size;
+
+            std::vector<std::byte> compressed(compressor.compress_bound(size));
+            compressed.resize(compressor.compress(in, compressed));
+            std::vector<std::byte> expected(compress_bound(size, options));
+            expected.resize(compress(in, expected, options));
+            ASSERT_EQ(compressed, expected);
+
+            std::vector<std::byte> out(size);
+            ASSERT_EQ(decompressor.decompress(compressed, out), size);
+            ASSERT_TRUE(std::equal(out.begin(), out.end(), in.begin()));
+            decompressor.verify(compressed);
+
+            std::vector<std::byte> slice(size / 2);
+            decompressor.decompress_range(compressed, size / 4, slice);
+            ASSERT_TRUE(std::equal(slice.begin(), slice.end(), in.begin() + size / 4));
+        }
+    }
+
+    // Once a context has seen a message of a codec and size, more of them do
+    // not touch the heap
+    auto dictionary = SprayPaintDictionary::train(std::as_bytes(std::span(text.data(), 100000)));
+    for (auto codec : {SprayPaintCodec::Static, SprayPaintCodec::Adaptive, SprayPaintCodec::Context,
+                       SprayPaintCodec::Interleaved, SprayPaintCodec::Dictionary}) {
+        SprayPaintOptions options;
+        options.threads = 1;
+        options.block_size = 4096;
+        options.codec = codec;
+        options.dictionary = codec == SprayPaintCodec::Dictionary ? &dictionary : nullptr;
+        SprayPaintCompressor compressor(options);
+        SprayPaintDecompressor decompressor(options);
+        std::vector<std::byte> compressed(compressor.compress_bound(5000));
+        std::vector<std::byte> out(5000);
+
+        for (size_t pos : {0, 5000, 10000}) {
+            auto in = std::as_bytes(std::span(text.data() + pos, 5000));
+            auto before = allocations.load();
+            auto message = std::span(compressed).first(compressor.compress(in, compressed));
+            decompressor.decompress(message, out);
+            decompressor.verify(message);
+            decompressor.decompress_range(message, 3000, std::span(out).first(2000));
+            auto allocated = allocations.load() - before;
+            // The first message sets up the scratch memory, which shows the counter works
+            ASSERT_EQ(allocated == 0, pos != 0) << "codec " << static_cast<int>(codec) << ", " << allocated;
+            ASSERT_TRUE(std::equal(out.begin(), out.begin() + 2000, in.begin() + 3000));
+        }
+    }
+
+    // A context that runs blocks on its pool keeps it for the next call
+    SprayPaintOptions options;
+    options.threads = 2;
+    options.block_size = 4096;
+    SprayPaintCompressor compressor(options);
+    SprayPaintDecompressor decompressor(options);
+    auto in = std::as_bytes(std::span(text.data(), 50000));
+    for (int i = 0; i < 3; ++i) {
+        std::vector<std::byte> compressed(compressor.compress_bound(in.size()));
+        compressed.resize(compressor.compress(in, compressed));
+        std::vector<std::byte> out(in.size());
+        decompressor.decompress(compressed, out);
+        ASSERT_TRUE(std::equal(out.begin(), out.end(), in.begin()));
+    }
+
+    SprayPaintOptions bad;
+    bad.block_size = 0;
+    ASSERT_ANY_THROW(SprayPaintCompressor{bad});
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintDictionary) {
+    auto text = read_file("../tests/lm.txt");
+    auto half = text.size() / 2;
+    auto dictionary = SprayPaintDictionary::train(std::as_bytes(std::span(text.data(), half)));
+
+    // Every byte has a code, even ones the sample never had
+    for (int sym = 0; sym < 256; ++sym) {
+        ASSERT_NE(dictionary.lengths()[sym], 0);
+    }
+
+    // Round trips through its file, same codes and same id
+    dictionary.save("lm.spd");
+    auto loaded = SprayPaintDictionary::load("lm.spd");
+    ASSERT_EQ(loaded.lengths(), dictionary.lengths());
+    ASSERT_EQ(loaded.id(), dictionary.id());
+    auto bytes = dictionary.serialize();
+    bytes.back() ^= 0x10;
+    ASSERT_ANY_THROW(SprayPaintDictionary::deserialize(bytes.data(), bytes.size()));
+
+    SprayPaintOptions options;
+    options.codec = SprayPaintCodec::Dictionary;
+    options.dictionary = &loaded;
+    SprayPaintOptions plain;
+
+    // Small messages from the half the dictionary was not trained on come out
+    // smaller than with their own codes, and the 200KB one no worse
+    for (size_t size : {64, 300, 1000, 4000, 200000}) {
+        auto in = std::as_bytes(std::span(text.data() + half, std::min(size, text.size() - half)));
+        std::vector<std::byte> compressed(compress_bound(in.size(), options));
+        compressed.resize(compress(in, compressed, options));
+        std::vector<std::byte> own(compress_bound(in.size(), plain));
+        own.resize(compress(in, own, plain));
+        if (size <= 4000) {
+            ASSERT_LT(compressed.size(), own.size());
+        } else {
+            ASSERT_LE(compressed.size(), own.size() + 4);
+        }
+
+        std::vector<std::byte> out(in.size());
+        decompress(compressed, out, options);
+        ASSERT_TRUE(std::equal(out.begin(), out.end(), in.begin()));
+        verify_compressed(compressed, options);
+
+        // Without the dictionary, or with another one, the file is refused
+        ASSERT_ANY_THROW(decompress(compressed, out));
+        auto other = SprayPaintDictionary::train(std::as_bytes(std::span(text.data() + half, half)));
+        SprayPaintOptions wrong;
+        wrong.dictionary = &other;
+        ASSERT_ANY_THROW(decompress(compressed, out, wrong));
+    }
+
+    // Streams carry the dictionary id as well
+    std::istringstream in(text.substr(0, 500));
+    std::ostringstream compressed;
+    SprayPaintStream(options).write(in, compressed);
+    std::istringstream compressed_in(compressed.str());
+    std::ostringstream out;
+    SprayPaintStream(options).read(compressed_in, out);
+    ASSERT_EQ(out.str(), text.substr(0, 500));
+
+    options.dictionary = nullptr;
+    ASSERT_ANY_THROW(validate_options(options));
+}
+
+TEST_F(SprayPaintTest, TestSprayPaintFileEmpty) {
+    {
+        std::ofstream out("empty.txt", std::ios::binary);
+    }
+
+    SprayPaintFile("empty.spz", "empty.txt").write();
+    SprayPaintFile("empty_out.txt", "empty.spz").read();
+    ASSERT_EQ(read_file("empty_out.txt"), "");
+
+    // Anything that is not a spray paint file is rejected
+    ASSERT_ANY_THROW(SprayPaintFile("nope.txt", "empty.txt").read());
+}